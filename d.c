@@ -1,46 +1,114 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "d.h"
 #include "a.h"
 
-static void _init_buffer(GLuint* buffer, size_t sz, void** data, GLuint type)
+// returns where writes go: the mapped ring, or one segment of client memory
+static void* _init_buffer(GLuint* buffer, size_t segment_sz, GLuint type, int persistent)
 {
 	glGenBuffers(1, buffer); CHKGL;
 	glBindBuffer(type, *buffer); CHKGL;
-	*data = malloc(sz);
-	AN(*data);
-	glBufferData(type, sz, *data, GL_STREAM_DRAW); CHKGL;
+	size_t sz = segment_sz * DBUF_SEGMENTS;
+	void* data;
+	if (persistent) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(type, sz, NULL, flags); CHKGL;
+		data = glMapBufferRange(type, 0, sz, flags); CHKGL;
+	} else {
+		glBufferData(type, sz, NULL, GL_STREAM_DRAW); CHKGL;
+		data = malloc(segment_sz);
+	}
+	AN(data);
+	return data;
+}
+
+static void _dbuf_enter_segment(struct dbuf* dbuf)
+{
+	GLsync* fence = &dbuf->fence[dbuf->segment];
+	if (*fence != NULL) {
+		GLenum r = glClientWaitSync(*fence, 0, 0);
+		if (r == GL_TIMEOUT_EXPIRED) {
+			dbuf->stalls++;
+			do {
+				r = glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+			} while (r == GL_TIMEOUT_EXPIRED);
+		}
+		if (r == GL_WAIT_FAILED) arghf("glClientWaitSync() failed");
+		glDeleteSync(*fence); CHKGL;
+		*fence = NULL;
+	}
+
+	dbuf->vertex_used = dbuf->vertex_drawn = 0;
+	dbuf->index_used = dbuf->index_drawn = 0;
+	if (dbuf->persistent) {
+		dbuf->vertex_data = dbuf->vertex_map + dbuf->segment * dbuf->vertex_buffer_sz;
+		dbuf->index_data = dbuf->index_map + dbuf->segment * dbuf->index_buffer_sz;
+	} else {
+		dbuf->vertex_data = dbuf->vertex_map;
+		dbuf->index_data = dbuf->index_map;
+	}
+}
+
+static void _dbuf_next_segment(struct dbuf* dbuf)
+{
+	ASSERT(dbuf->index_drawn == dbuf->index_used);
+	if (dbuf->fenced) {
+		dbuf->fence[dbuf->segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0); CHKGL;
+	}
+	dbuf->segment = (dbuf->segment + 1) % DBUF_SEGMENTS;
+	_dbuf_enter_segment(dbuf);
 }
 
 void dbuf_init(struct dbuf* dbuf, size_t vertex_buffer_sz, size_t index_buffer_sz)
 {
-	_init_buffer(
+	dbuf->fenced = GLEW_ARB_sync;
+	dbuf->persistent = dbuf->fenced && GLEW_ARB_buffer_storage;
+	dbuf->segment = 0;
+	for (int i = 0; i < DBUF_SEGMENTS; i++) dbuf->fence[i] = NULL;
+	dbuf->stalls = 0;
+
+	dbuf->vertex_map = _init_buffer(
 		&dbuf->vertex_buffer,
 		(dbuf->vertex_buffer_sz = vertex_buffer_sz) * sizeof(float),
-		(void**) &dbuf->vertex_data,
-		GL_ARRAY_BUFFER
+		GL_ARRAY_BUFFER,
+		dbuf->persistent
 	);
 
-	_init_buffer(
+	dbuf->index_map = _init_buffer(
 		&dbuf->index_buffer,
 		(dbuf->index_buffer_sz = index_buffer_sz) * sizeof(int32_t),
-		(void**) &dbuf->index_data,
-		GL_ELEMENT_ARRAY_BUFFER
+		GL_ELEMENT_ARRAY_BUFFER,
+		dbuf->persistent
 	);
+
+	_dbuf_enter_segment(dbuf);
 }
 
-static void _dbuf_reset(struct dbuf* dbuf)
+// copies elements [from;to) of the current segment's client memory to the buffer
+static void _dbuf_upload(struct dbuf* dbuf, GLenum type, size_t segment_sz, size_t elem_sz, void* src, size_t from, size_t to)
 {
-	dbuf->vertex_used = 0;
-	dbuf->index_used = 0;
+	size_t offset = (dbuf->segment * segment_sz + from) * elem_sz;
+	size_t sz = (to - from) * elem_sz;
+	char* p = (char*)src + from * elem_sz;
+	if (dbuf->fenced) {
+		// the fences keep the gpu off this range; no need for the driver to check
+		void* dst = glMapBufferRange(type, offset, sz, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT); CHKGL;
+		AN(dst);
+		memcpy(dst, p, sz);
+		glUnmapBuffer(type); CHKGL;
+	} else {
+		glBufferSubData(type, offset, sz, p); CHKGL;
+	}
 }
 
-void dtype_init(struct dtype* dtype, struct dbuf* dbuf, const char* vertex_shader, const char* fragment_shader, struct dtype_attr_spec attr_specs[])
+void dtype_init(struct dtype* dtype, struct dbuf* dbuf, struct shader_camera* camera, const char* vertex_shader, const char* fragment_shader, struct dtype_attr_spec attr_specs[])
 {
 	dtype->dbuf = dbuf;
-	shader_init(&dtype->shader, vertex_shader, fragment_shader);
+	dtype->camera = camera;
 
+	const char* names[DTYPE_ATTR_MAX + 1];
 	struct dtype_attr_spec* attr_spec = attr_specs;
 	dtype->attr_count = 0;
 	dtype->floats_per_vertex = 0;
@@ -48,46 +116,93 @@ void dtype_init(struct dtype* dtype, struct dbuf* dbuf, const char* vertex_shade
 		ASSERT(attr_spec->n_floats >= 1);
 		ASSERT(dtype->attr_count < DTYPE_ATTR_MAX);
 
-		dtype->attr[dtype->attr_count] = glGetAttribLocation(dtype->shader.program, attr_spec->symbol); CHKGL;
+		names[dtype->attr_count] = attr_spec->symbol;
+		dtype->attr[dtype->attr_count] = dtype->attr_count;
 		dtype->attr_n_floats[dtype->attr_count] = attr_spec->n_floats;
 		dtype->floats_per_vertex += attr_spec->n_floats;
 
 		attr_spec++;
 		dtype->attr_count++;
 	}
+	names[dtype->attr_count] = NULL;
+
+	shader_init(&dtype->shader, vertex_shader, fragment_shader, names);
+
+	/* with a vertex array object the enabled attributes, the index buffer
+	 * and the last attribute pointers stay put between begin/end pairs */
+	dtype->vao = 0;
+	if (GLEW_ARB_vertex_array_object) {
+		glGenVertexArrays(1, &dtype->vao); CHKGL;
+		glBindVertexArray(dtype->vao); CHKGL;
+		for (int i = 0; i < dtype->attr_count; i++) glEnableVertexAttribArray(dtype->attr[i]);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, dbuf->index_buffer); CHKGL;
+		glBindVertexArray(0); CHKGL;
+	}
 
 	dtype->vertex_next_seq = -1;
+	dtype->pointers_segment = -1;
 }
 
 void dtype_begin(struct dtype* dtype)
 {
 	ASSERT(dtype->vertex_next_seq == -1);
-	shader_use(&dtype->shader);
-	for (int i = 0; i < dtype->attr_count; i++) {
-		glEnableVertexAttribArray(dtype->attr[i]); CHKGL;
+	shader_use(&dtype->shader, dtype->camera);
+	if (dtype->vao) {
+		glBindVertexArray(dtype->vao); CHKGL;
+	} else {
+		for (int i = 0; i < dtype->attr_count; i++) glEnableVertexAttribArray(dtype->attr[i]);
+		CHKGL;
+		dtype->pointers_segment = -1;
 	}
 	dtype->vertex_next_seq = 0;
-	_dbuf_reset(dtype->dbuf);
+
+	/* indices count vertices from the segment start, in this dtype's
+	 * stride; pad to it */
+	struct dbuf* dbuf = dtype->dbuf;
+	ASSERT(dbuf->index_drawn == dbuf->index_used);
+	size_t fpv = dtype->floats_per_vertex;
+	dbuf->vertex_used = ((dbuf->vertex_used + fpv - 1) / fpv) * fpv;
+	if (dbuf->vertex_used > dbuf->vertex_buffer_sz) _dbuf_next_segment(dbuf);
+	dbuf->vertex_drawn = dbuf->vertex_used;
+}
+
+// for whatever is bound to GL_ARRAY_BUFFER, starting at float base
+static void _dtype_attrib_pointers(struct dtype* dtype, size_t base)
+{
+	size_t offset = base;
+	for (int i = 0; i < dtype->attr_count; i++) {
+		glVertexAttribPointer(dtype->attr[i], dtype->attr_n_floats[i], GL_FLOAT, GL_FALSE, dtype->floats_per_vertex * sizeof(float), (char*)(sizeof(float)*offset)); CHKGL;
+		offset += dtype->attr_n_floats[i];
+	}
 }
 
 static void _dtype_flush(struct dtype* dtype)
 {
 	struct dbuf* dbuf = dtype->dbuf;
+	if (dbuf->index_used == dbuf->index_drawn) return;
 
-	glBindBuffer(GL_ARRAY_BUFFER, dbuf->vertex_buffer); CHKGL;
-	glBufferSubData(GL_ARRAY_BUFFER, 0, dbuf->vertex_used * sizeof(float), dbuf->vertex_data); CHKGL;
+	int pointers = dtype->pointers_segment != dbuf->segment;
+	if (pointers || !dbuf->persistent) {
+		glBindBuffer(GL_ARRAY_BUFFER, dbuf->vertex_buffer); CHKGL;
+	}
+	if (!dtype->vao) {
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, dbuf->index_buffer); CHKGL;
+	}
+	if (!dbuf->persistent) {
+		_dbuf_upload(dbuf, GL_ARRAY_BUFFER, dbuf->vertex_buffer_sz, sizeof(float), dbuf->vertex_data, dbuf->vertex_drawn, dbuf->vertex_used);
+		_dbuf_upload(dbuf, GL_ELEMENT_ARRAY_BUFFER, dbuf->index_buffer_sz, sizeof(int32_t), dbuf->index_data, dbuf->index_drawn, dbuf->index_used);
+	}
 
-	size_t offset = 0;
-	for (int i = 0; i < dtype->attr_count; i++) {
-		glVertexAttribPointer(dtype->attr[i], dtype->attr_n_floats[i], GL_FLOAT, GL_FALSE, dtype->floats_per_vertex * sizeof(float), (char*)(sizeof(float)*offset)); CHKGL;
-		offset += dtype->attr_n_floats[i];
+	if (pointers) {
+		_dtype_attrib_pointers(dtype, dbuf->segment * dbuf->vertex_buffer_sz);
+		dtype->pointers_segment = dbuf->segment;
 	}
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, dbuf->index_buffer); CHKGL;
-	glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, dbuf->index_used * sizeof(int32_t), dbuf->index_data); CHKGL;
-	glDrawElements(GL_TRIANGLES, dbuf->index_used, GL_UNSIGNED_INT, NULL); CHKGL;
+	size_t first = dbuf->segment * dbuf->index_buffer_sz + dbuf->index_drawn;
+	glDrawElements(GL_TRIANGLES, dbuf->index_used - dbuf->index_drawn, GL_UNSIGNED_INT, (char*)(first * sizeof(int32_t))); CHKGL;
 
-	_dbuf_reset(dtype->dbuf);
+	dbuf->vertex_drawn = dbuf->vertex_used;
+	dbuf->index_drawn = dbuf->index_used;
 }
 
 void dtype_end(struct dtype* dtype)
@@ -95,18 +210,33 @@ void dtype_end(struct dtype* dtype)
 	ASSERT(dtype->vertex_next_seq >= 0);
 	dtype->vertex_next_seq = -1;
 	_dtype_flush(dtype);
-	for (int i = 0; i < dtype->attr_count; i++) {
-		glDisableVertexAttribArray(dtype->attr[i]); CHKGL;
+	if (dtype->vao) {
+		glBindVertexArray(0); CHKGL;
+	} else {
+		for (int i = 0; i < dtype->attr_count; i++) glDisableVertexAttribArray(dtype->attr[i]);
+		CHKGL;
 	}
 	glUseProgram(0); CHKGL;
 }
 
-void dtype_set_matrix(struct dtype* dtype, const char* uniform_name, struct mat44* matrix)
+void dtype_draw_arrays(struct dtype* dtype, GLuint vertex_buffer, GLenum mode, int first, int count)
 {
 	ASSERT(dtype->vertex_next_seq >= 0);
+	if (count == 0) return;
+	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer); CHKGL;
+	_dtype_attrib_pointers(dtype, 0);
+	dtype->pointers_segment = -1;
+	glDrawArrays(mode, first, count); CHKGL;
+}
 
-	GLint location = glGetUniformLocation(dtype->shader.program, uniform_name);
-	glUniformMatrix4fv(location, 1, GL_FALSE, matrix->s);
+void dtype_multi_draw_arrays(struct dtype* dtype, GLuint vertex_buffer, GLenum mode, GLint* first, GLsizei* count, int n)
+{
+	ASSERT(dtype->vertex_next_seq >= 0);
+	if (n == 0) return;
+	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer); CHKGL;
+	_dtype_attrib_pointers(dtype, 0);
+	dtype->pointers_segment = -1;
+	glMultiDrawArrays(mode, first, count, n); CHKGL;
 }
 
 static void _dtype_requires(struct dtype* dtype, int vertices, int indices)
@@ -115,6 +245,7 @@ static void _dtype_requires(struct dtype* dtype, int vertices, int indices)
 	struct dbuf* dbuf = dtype->dbuf;
 	if (dbuf->vertex_used + vertex_floats > dbuf->vertex_buffer_sz || dbuf->index_used + indices > dbuf->index_buffer_sz) {
 		_dtype_flush(dtype);
+		_dbuf_next_segment(dbuf);
 	}
 	ASSERT(dbuf->vertex_used + vertex_floats <= dbuf->vertex_buffer_sz && dbuf->index_used + indices <= dbuf->index_buffer_sz);
 }
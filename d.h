@@ -5,16 +5,37 @@
 #include "m.h"
 #include "a.h"
 
+/* streaming buffers for dtype, each a ring of DBUF_SEGMENTS segments of
+ * vertex_buffer_sz floats / index_buffer_sz indices. writes append to the
+ * current segment and a flush draws only what's new since the last one, so
+ * nothing in flight is ever overwritten; when a segment fills the ring moves
+ * on, fencing the segment it leaves and waiting on the fence of the one it
+ * enters, which has normally long passed. with ARB_buffer_storage the ring is
+ * mapped once, persistent and coherent, and vertex_data/index_data point
+ * straight into it; else they point at a segment of client memory which each
+ * flush copies over with an unsynchronized glMapBufferRange() */
+#define DBUF_SEGMENTS (4)
+
 struct dbuf {
+	int persistent;
+	int fenced; // ARB_sync; without it uploads fall back to glBufferSubData()
+	int segment;
+	GLsync fence[DBUF_SEGMENTS];
+	int stalls; // fence waits that blocked
+
 	GLuint vertex_buffer;
-	size_t vertex_buffer_sz;
-	float* vertex_data;
+	size_t vertex_buffer_sz; // per segment
+	float* vertex_map; // the whole ring if persistent, else one segment
+	float* vertex_data; // the current segment
 	size_t vertex_used;
+	size_t vertex_drawn;
 
 	GLuint index_buffer;
 	size_t index_buffer_sz;
+	int32_t* index_map;
 	int32_t* index_data;
 	size_t index_used;
+	size_t index_drawn;
 };
 
 void dbuf_init(struct dbuf* dbuf, size_t vertex_buffer_sz, size_t index_buffer_sz);
@@ -29,22 +50,28 @@ struct dtype_attr_spec {
 struct dtype {
 	struct dbuf* dbuf;
 	struct shader shader;
+	struct shader_camera* camera;
+	GLuint vao; // 0 without ARB_vertex_array_object
 
-	GLuint attr[DTYPE_ATTR_MAX];
+	GLuint attr[DTYPE_ATTR_MAX]; // bound at link time, in attr_specs order
 	int attr_n_floats[DTYPE_ATTR_MAX];
 	int attr_count;
 	int floats_per_vertex;
 
 	int vertex_next_seq;
+	int pointers_segment; // dbuf segment the attribute pointers are set for, or -1
 };
 
-void dtype_init(struct dtype* dtype, struct dbuf* dbuf, const char* vertex_shader, const char* fragment_shader, struct dtype_attr_spec attr_specs[]);
+void dtype_init(struct dtype* dtype, struct dbuf* dbuf, struct shader_camera* camera, const char* vertex_shader, const char* fragment_shader, struct dtype_attr_spec attr_specs[]);
 
 void dtype_begin(struct dtype* dtype);
 void dtype_end(struct dtype* dtype);
 
-
-void dtype_set_matrix(struct dtype* dtype, const char* uniform_name, struct mat44* matrix);
+/* draws count vertices from a caller-owned vertex buffer laid out like the
+ * dtype's own; between dtype_begin() and dtype_end() */
+void dtype_draw_arrays(struct dtype* dtype, GLuint vertex_buffer, GLenum mode, int first, int count);
+// likewise, n ranges in one glMultiDrawArrays()
+void dtype_multi_draw_arrays(struct dtype* dtype, GLuint vertex_buffer, GLenum mode, GLint* first, GLsizei* count, int n);
 
 void dtype_new_triangle(struct dtype* dtype);
 void dtype_new_quad(struct dtype* dtype);
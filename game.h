@@ -1,17 +1,29 @@
 #ifndef GAME_H
 #define GAME_H
 
-#include "render.h"
 #include "track.h"
 #include "sim.h"
 
+struct render;
+struct replay_recorder;
+struct replay_player;
+
 struct game {
-	float dt;
+	int threaded_sim;
+	// at most one of these; not with threaded_sim
+	struct replay_recorder* recorder;
+	struct replay_player* player;
 	struct track* track;
 	struct sim* sim;
 };
 
-void game_init(struct game* game, float dt, struct track* track);
+// sim_threads: see sim_new()
+void game_init(struct game* game, struct track* track, int sim_threads);
+void game_free(struct game* game);
+void game_print_stats(struct game* game);
+
+/* game_run.c; everything that needs SDL or GL goes there. closes the
+ * recorder, and with a player returns once the replay has ended */
 void game_run(struct game* game, struct render* render);
 
 #endif/*GAME_H*/
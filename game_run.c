@@ -0,0 +1,218 @@
+#include <stdio.h>
+
+#include "game.h"
+#include "render.h"
+#include "replay.h"
+
+void game_run(struct game* game, struct render* render)
+{
+	SDL_SetRelativeMouseMode(SDL_TRUE);
+
+	float yaw = 180;
+	float pitch = 0;
+	struct vec3 fly_position;
+
+	int ctrl_accel = 0;
+	int ctrl_brake = 0;
+	int ctrl_steer_left = 0;
+	int ctrl_steer_right = 0;
+
+	int ctrl_fly_forward = 0;
+	int ctrl_fly_backward = 0;
+	int ctrl_fly_left = 0;
+	int ctrl_fly_right = 0;
+
+	int exiting = 0;
+	int fly_mode = 0;
+
+	struct mat44 last_vehicle_view;
+
+	// physics LOD around the camera; the focus isn't recorded, so not with replays
+	int lod = game->recorder == NULL && game->player == NULL;
+	if (lod) {
+		struct track_path path;
+		track_path_build(&path, game->track);
+		sim_set_lod_path(game->sim, path.points, path.n, path.closed);
+		track_path_free(&path);
+	}
+
+	if (game->threaded_sim) {
+		// steps happen on their own schedule there
+		ASSERT(game->recorder == NULL && game->player == NULL);
+		sim_thread_start(game->sim);
+	}
+
+	double counter_freq = (double)SDL_GetPerformanceFrequency();
+	Uint64 counter_last = SDL_GetPerformanceCounter();
+
+	while (!exiting) {
+		SDL_Event e;
+		int mdx = 0;
+		int mdy = 0;
+		while (SDL_PollEvent(&e)) {
+			if (e.type == SDL_QUIT) exiting = 1;
+
+			struct push_key {
+				SDL_Keycode sym;
+				int* intptr;
+			} push_keys[] = {
+				{SDLK_UP, &ctrl_accel},
+				{SDLK_DOWN, &ctrl_brake},
+				{SDLK_LEFT, &ctrl_steer_left},
+				{SDLK_RIGHT, &ctrl_steer_right},
+				{SDLK_w, &ctrl_fly_forward},
+				{SDLK_s, &ctrl_fly_backward},
+				{SDLK_a, &ctrl_fly_left},
+				{SDLK_d, &ctrl_fly_right},
+				{-1, NULL}
+			};
+
+			for (struct push_key* tkp = push_keys; tkp->intptr != NULL; tkp++) {
+				if ((e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) && e.key.keysym.sym == tkp->sym) {
+					*(tkp->intptr) = (e.type == SDL_KEYDOWN);
+				}
+			}
+
+			if (e.type == SDL_KEYDOWN) {
+				if (e.key.keysym.sym == SDLK_ESCAPE) {
+					exiting = 1;
+				}
+				if (e.key.keysym.sym == SDLK_TAB) {
+					fly_mode = !fly_mode;
+					if (fly_mode) {
+						yaw = 0;
+						vec3_zero(&fly_position);
+					} else {
+						yaw = 180;
+					}
+				}
+			}
+			if (e.type == SDL_MOUSEMOTION) {
+				mdx += e.motion.xrel;
+				mdy += e.motion.yrel;
+			}
+		}
+
+		{
+			float sensitivity = 0.1f;
+			yaw += (float)mdx * sensitivity;
+			pitch += (float)mdy * sensitivity;
+			float pitch_limit = 90;
+			if (pitch > pitch_limit) pitch = pitch_limit;
+			if (pitch < -pitch_limit) pitch = -pitch_limit;
+		}
+
+		{
+			float speed = 0.5f;
+			float forward = (float)(ctrl_fly_forward - ctrl_fly_backward) * speed;
+			float right = (float)(ctrl_fly_right - ctrl_fly_left) * speed;
+			struct vec3 movement;
+			vec3_move(&movement, yaw, pitch, forward, right);
+			vec3_add_inplace(&fly_position, &movement);
+		}
+
+
+
+		struct sim_ctrl ctrl;
+		ctrl.accel = ctrl_accel;
+		ctrl.brake = ctrl_brake;
+		ctrl.steer = ctrl_steer_right - ctrl_steer_left;
+		if (game->player == NULL) sim_apply_controls(game->sim, &ctrl, 1);
+
+		if (game->threaded_sim) {
+			sim_latch_poses(game->sim);
+		} else {
+			Uint64 counter = SDL_GetPerformanceCounter();
+			double dt = (double)(counter - counter_last) / counter_freq;
+			counter_last = counter;
+			if (game->player != NULL) {
+				replay_play_realtime(game->player, game->sim, dt);
+				if (replay_player_done(game->player)) exiting = 1;
+			} else {
+				int n = sim_step(game->sim, dt);
+				if (game->recorder != NULL) replay_record(game->recorder, &ctrl, n);
+			}
+		}
+
+		/* the sim's poses are relative to its floating origin, the track
+		 * is in world coordinates; the world view is the sim view moved
+		 * by the origin. the vehicle view is built in sim coordinates so
+		 * it doesn't lose precision far from the world origin */
+		struct vec3 origin;
+		sim_get_origin(game->sim, &origin);
+		struct vec3 to_world;
+		vec3_scale(&to_world, &origin, -1);
+		struct mat44 sim_view;
+
+		if (fly_mode) {
+			mat44_set_identity(&render->view);
+			mat44_rotate_x(&render->view, pitch);
+			mat44_rotate_y(&render->view, yaw);
+
+			struct vec3 translate;
+			vec3_scale(&translate, &fly_position, -1);
+			mat44_translate(&render->view, &translate);
+			mat44_multiply_inplace(&render->view, &last_vehicle_view);
+
+			mat44_copy(&sim_view, &render->view);
+			mat44_translate(&sim_view, &origin);
+		} else {
+			mat44_set_identity(&render->view);
+			mat44_rotate_x(&render->view, pitch);
+			mat44_rotate_y(&render->view, yaw);
+			struct vec3 up = {{0,-0.6,0}};
+			mat44_translate(&render->view, &up);
+			struct mat44 vtx;
+			struct sim_vehicle* vehicle = sim_get_vehicle(game->sim, 0);
+			sim_vehicle_get_tx(vehicle, &vtx);
+			mat44_multiply_inplace(&render->view, &vtx);
+
+			mat44_copy(&sim_view, &render->view);
+			mat44_translate(&render->view, &to_world);
+			mat44_copy(&last_vehicle_view, &render->view);
+		}
+
+		if (lod) {
+			// the camera in sim coordinates, looking down its -Z
+			struct mat44 camera;
+			mat44_inverse(&camera, &sim_view);
+			struct vec3 position = {{mat44_at(&camera, 3, 0), mat44_at(&camera, 3, 1), mat44_at(&camera, 3, 2)}};
+			struct vec3 direction = {{-mat44_at(&camera, 2, 0), -mat44_at(&camera, 2, 1), -mat44_at(&camera, 2, 2)}};
+			sim_set_lod_focus(game->sim, &position, &direction);
+		}
+
+		render_clear(render);
+		render_horizon(render);
+		render_track(render, game->track);
+
+		mat44_copy(&render->view, &sim_view);
+		render_vehicles(render, game->sim);
+
+		int n_vehicles = sim_vehicle_count(game->sim);
+
+		for (int depth_mode = 0; depth_mode < 2; depth_mode++) {
+			render_begin_color(render, depth_mode);
+			for (int i = 0; i < n_vehicles; i++) {
+				struct sim_vehicle_pose pose;
+				sim_vehicle_get_pose(sim_get_vehicle(game->sim, i), &pose);
+				render_vehicle_visualize(render, &pose);
+			}
+			render_end_color(render);
+		}
+
+		render_flip(render);
+	}
+
+	if (game->threaded_sim) sim_thread_stop(game->sim);
+
+	if (game->recorder != NULL) replay_recorder_close(game->recorder, game->sim);
+	if (game->player != NULL) {
+		if (replay_player_done(game->player)) {
+			printf("replay: %s\n", replay_player_verify(game->player, game->sim) ? "ok" : "DIVERGED");
+		} else {
+			printf("replay: stopped early\n");
+		}
+	}
+
+	game_print_stats(game);
+}
@@ -0,0 +1,505 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "a.h"
+#include "m.h"
+#include "track.h"
+#include "sim.h"
+#include "game.h"
+#include "replay.h"
+
+/* runs the sim without SDL/GL as fast as the CPU allows, driven by a
+ * control script; for regression runs and tuning on boxes without a
+ * display.
+ *
+ * script format; one segment per line, '#' starts a comment:
+ *   <steps> <accel> <brake> <steer>
+ * where steer is -1, 0 or 1 like in game_run()
+ *
+ * with -sweep <n>, n copies of the sim run the script side by side in a
+ * sim_pool, each with randomized wheel tuning, and one line per
+ * configuration is printed with its final chassis position
+ *
+ * with -vehicles <n>, n vehicles are spawned on a grid around the start
+ * and all of them follow the script
+ *
+ * -j <n> steps each sim with n Bullet worker threads (SIM_MT builds);
+ * -scaling <n> reruns the script with 1..n workers and prints the step
+ * time for each
+ *
+ * -rewind runs the script once, snapshots the sim, runs it again, then
+ * restores and runs it a third time, and checks that the last two runs
+ * end bit-identically
+ *
+ * -reset runs the script, sim_reset()s and runs it again on the same
+ * track mesh, and checks that the rerun ends bit-identically too
+ *
+ * -nostream puts the whole track mesh in the world up front instead of
+ * streaming its chunks in around the vehicles
+ *
+ * -record <file> writes the run as a replay; -play <file> plays a replay
+ * (from here or from the game) back as fast as possible instead of the
+ * script and checks that it ends where the recording did */
+
+struct script_segment {
+	int steps;
+	int accel;
+	int brake;
+	int steer;
+};
+
+struct script {
+	struct script_segment* segments;
+	int n;
+	int cap;
+};
+
+static void script_add(struct script* script, int steps, int accel, int brake, int steer)
+{
+	if (script->n == script->cap) {
+		script->cap = script->cap ? script->cap * 2 : 64;
+		script->segments = realloc(script->segments, script->cap * sizeof(struct script_segment));
+		AN(script->segments);
+	}
+	struct script_segment* seg = &script->segments[script->n++];
+	seg->steps = steps;
+	seg->accel = accel;
+	seg->brake = brake;
+	seg->steer = steer;
+}
+
+static void script_load(struct script* script, const char* path)
+{
+	FILE* f = fopen(path, "r");
+	if (f == NULL) arghf("%s: cannot open\n", path);
+	char line[256];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		char* comment = strchr(line, '#');
+		if (comment != NULL) *comment = 0;
+		int steps, accel, brake, steer;
+		int n = sscanf(line, "%d %d %d %d", &steps, &accel, &brake, &steer);
+		if (n <= 0) continue;
+		if (n != 4 || steps < 0) arghf("%s:%d: expected <steps> <accel> <brake> <steer>\n", path, lineno);
+		script_add(script, steps, accel, brake, steer);
+	}
+	fclose(f);
+}
+
+static void script_init_demo(struct script* script)
+{
+	// roughly a lap of track_init_demo()
+	script_add(script, 120, 0, 0, 0);
+	script_add(script, 180, 1, 0, 0);
+	script_add(script, 90, 1, 0, 1);
+	script_add(script, 120, 1, 0, 0);
+	script_add(script, 60, 0, 1, 0);
+	script_add(script, 90, 1, 0, 1);
+	script_add(script, 240, 1, 0, 0);
+}
+
+static double seconds()
+{
+	struct timespec ts;
+	AZ(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static float sweep_rand(uint32_t* state, float min, float max)
+{
+	*state = *state * 1664525u + 1013904223u;
+	return min + (max - min) * (float)(*state >> 8) / (float)(1 << 24);
+}
+
+static void add_vehicles(struct sim* sim, int n, int lite)
+{
+	// spread the extra vehicles on a grid behind vehicle 0
+	for (int i = sim_vehicle_count(sim); i < n; i++) {
+		struct vec3 position = {{10 + (i % 8) * 4, 20 + (i / 64) * 4, 10 - ((i / 8) % 8) * 6}};
+		if (lite) {
+			sim_add_lite_vehicle(sim, &position, -1.5);
+		} else {
+			sim_add_vehicle(sim, &position, -1.5);
+		}
+	}
+}
+
+// every vehicle follows the script; returns the number of steps taken
+static long run_script(struct sim* sim, struct script* script, int repeat, struct replay_recorder* rec)
+{
+	int n_vehicles = sim_vehicle_count(sim);
+	struct sim_ctrl* ctrls = malloc(n_vehicles * sizeof(struct sim_ctrl));
+	AN(ctrls);
+
+	long steps = 0;
+	for (int r = 0; r < repeat; r++) {
+		for (int i = 0; i < script->n; i++) {
+			struct script_segment* seg = &script->segments[i];
+			for (int j = 0; j < n_vehicles; j++) {
+				ctrls[j].accel = seg->accel;
+				ctrls[j].brake = seg->brake;
+				ctrls[j].steer = seg->steer;
+			}
+			sim_apply_controls(sim, ctrls, n_vehicles);
+			sim_step_fixed(sim, seg->steps);
+			if (rec != NULL) replay_record(rec, ctrls, seg->steps);
+			steps += seg->steps;
+		}
+	}
+
+	free(ctrls);
+	return steps;
+}
+
+static void run_scaling(struct track* track, struct script* script, int repeat, int max_threads, int n_vehicles, int hz)
+{
+	printf("# threads ms/step speedup\n");
+	double base = 0;
+	for (int t = 1; t <= max_threads; t++) {
+		struct game game;
+		game_init(&game, track, t);
+		if (hz > 0) sim_set_step_rate(game.sim, hz);
+		add_vehicles(game.sim, n_vehicles, 0);
+		run_script(game.sim, script, repeat, NULL);
+
+		struct sim_stats stats;
+		sim_get_stats(game.sim, &stats);
+		if (t == 1) base = stats.step_time;
+		printf("%d %.3f %.2f\n", stats.n_threads, stats.step_time * 1e3, base / stats.step_time);
+		game_free(&game);
+	}
+}
+
+static void run_rewind(struct sim* sim, struct script* script, int repeat)
+{
+	// a lap first, so the snapshot has contacts, pairs and streamed
+	// chunks that the rerun changes before the restore
+	run_script(sim, script, repeat, NULL);
+
+	size_t sz = sim_snapshot_size(sim);
+	void* snapshot = malloc(sz);
+	AN(snapshot);
+	double t0 = seconds();
+	size_t used = sim_snapshot(sim, snapshot, sz);
+	double snapshot_time = seconds() - t0;
+	AN(used);
+
+	int n_vehicles = sim_vehicle_count(sim);
+	size_t poses_sz = n_vehicles * SIM_POSE_MATRICES * sizeof(struct mat44);
+	struct mat44* poses[2];
+	uint64_t hashes[2];
+	for (int i = 0; i < 2; i++) {
+		poses[i] = malloc(poses_sz);
+		AN(poses[i]);
+	}
+
+	double restore_time = 0;
+	for (int i = 0; i < 2; i++) {
+		if (i > 0) {
+			t0 = seconds();
+			sim_restore(sim, snapshot);
+			restore_time = seconds() - t0;
+		}
+		run_script(sim, script, repeat, NULL);
+		sim_get_poses(sim, poses[i], n_vehicles);
+		hashes[i] = sim_state_hash(sim);
+	}
+
+	int identical = hashes[0] == hashes[1] && memcmp(poses[0], poses[1], poses_sz) == 0;
+	printf("snapshot: %zu bytes, taken in %.1fus, restored in %.1fus; rerun %s\n",
+		used,
+		snapshot_time * 1e6,
+		restore_time * 1e6,
+		identical ? "bit-identical" : "DIVERGED");
+
+	for (int i = 0; i < 2; i++) free(poses[i]);
+	free(snapshot);
+	if (!identical) exit(EXIT_FAILURE);
+}
+
+static void run_reset(struct sim* sim, struct script* script, int repeat, int lite)
+{
+	int n_vehicles = sim_vehicle_count(sim);
+	size_t poses_sz = n_vehicles * SIM_POSE_MATRICES * sizeof(struct mat44);
+	struct mat44* poses[2];
+	for (int i = 0; i < 2; i++) {
+		poses[i] = malloc(poses_sz);
+		AN(poses[i]);
+	}
+
+	double reset_time = 0;
+	for (int i = 0; i < 2; i++) {
+		if (i > 0) {
+			double t0 = seconds();
+			sim_reset(sim);
+			reset_time = seconds() - t0;
+			add_vehicles(sim, n_vehicles, lite);
+			ASSERT(sim_vehicle_count(sim) == n_vehicles);
+		}
+		run_script(sim, script, repeat, NULL);
+		sim_get_poses(sim, poses[i], n_vehicles);
+	}
+
+	int identical = memcmp(poses[0], poses[1], poses_sz) == 0;
+	printf("reset in %.1fus; rerun %s\n",
+		reset_time * 1e6,
+		identical ? "bit-identical" : "DIVERGED");
+
+	for (int i = 0; i < 2; i++) free(poses[i]);
+	if (!identical) exit(EXIT_FAILURE);
+}
+
+// like game_init(), but with the whole track mesh in one body
+static void game_init_nostream(struct game* game, struct track* track, int sim_threads)
+{
+	memset(game, 0, sizeof(struct game));
+	game->track = track;
+	game->sim = sim_new(sim_threads);
+
+	struct track_mesh mesh;
+	track_mesh_build(&mesh, track);
+	if (mesh.n_triangles > 0) sim_set_track_mesh(game->sim, mesh.vertices, mesh.n_vertices, mesh.indices, mesh.n_triangles);
+	track_mesh_free(&mesh);
+}
+
+static void run_play(struct track* track, const char* path, int sim_threads)
+{
+	struct replay_player player;
+	replay_player_open(&player, path);
+
+	struct game game;
+	game_init(&game, track, sim_threads);
+	add_vehicles(game.sim, player.header.n_vehicles, 0);
+	replay_player_begin(&player, track, game.sim);
+
+	double t0 = seconds();
+	long steps = 0;
+	int n;
+	while ((n = replay_play(&player, game.sim, 1<<20)) > 0) steps += n;
+	double elapsed = seconds() - t0;
+
+	double sim_time = (double)steps * (double)sim_get_step_dt(game.sim);
+	int ok = replay_player_verify(&player, game.sim);
+	printf("%s: %ld steps (%.1fs sim time) in %.3fs, %.1fx realtime; %s\n",
+		path,
+		steps,
+		sim_time,
+		elapsed,
+		sim_time / elapsed,
+		ok ? "ok" : "DIVERGED");
+
+	replay_player_close(&player);
+	game_free(&game);
+	if (!ok) exit(EXIT_FAILURE);
+}
+
+static void run_sweep(struct track* track, struct script* script, int repeat, int n, int n_threads, int hz)
+{
+	struct sim_pool* pool = sim_pool_new(n, n_threads);
+
+	struct track_mesh mesh;
+	track_mesh_build(&mesh, track);
+	sim_pool_set_track_mesh(pool, mesh.vertices, mesh.n_vertices, mesh.indices, mesh.n_triangles);
+	track_mesh_free(&mesh);
+
+	struct sim_vehicle_tuning* tunings = malloc(n * sizeof(struct sim_vehicle_tuning));
+	AN(tunings);
+	uint32_t rng = 1;
+	for (int i = 0; i < n; i++) {
+		struct sim_vehicle_tuning* t = &tunings[i];
+		sim_vehicle_tuning_default(t);
+		if (i > 0) {
+			// config 0 is the default, as a reference
+			t->suspension_stiffness = sweep_rand(&rng, 5, 40);
+			t->damping_relaxation = sweep_rand(&rng, 1, 5);
+			t->damping_compression = sweep_rand(&rng, 1, 8);
+			t->friction_slip = sweep_rand(&rng, 1, 200);
+			t->roll_influence = sweep_rand(&rng, 0, 0.5);
+		}
+		struct sim* sim = sim_pool_get_sim(pool, i);
+		if (hz > 0) sim_set_step_rate(sim, hz);
+		sim_vehicle_set_tuning(sim_get_vehicle(sim, 0), t);
+	}
+
+	double t0 = seconds();
+	long steps = 0;
+	for (int r = 0; r < repeat; r++) {
+		for (int i = 0; i < script->n; i++) {
+			struct script_segment* seg = &script->segments[i];
+			for (int j = 0; j < n; j++) {
+				struct sim* sim = sim_pool_get_sim(pool, j);
+				sim_vehicle_ctrl(sim_get_vehicle(sim, 0), seg->accel, seg->brake, seg->steer);
+			}
+			sim_pool_step_fixed(pool, seg->steps);
+			steps += seg->steps;
+		}
+	}
+	double elapsed = seconds() - t0;
+
+	printf("# config stiffness relaxation compression slip roll x y z\n");
+	for (int i = 0; i < n; i++) {
+		struct sim_vehicle_tuning* t = &tunings[i];
+		struct sim_vehicle_pose pose;
+		sim_vehicle_get_pose(sim_get_vehicle(sim_pool_get_sim(pool, i), 0), &pose);
+		printf("%d %.3f %.3f %.3f %.3f %.3f %.3f %.3f %.3f\n",
+			i,
+			t->suspension_stiffness,
+			t->damping_relaxation,
+			t->damping_compression,
+			t->friction_slip,
+			t->roll_influence,
+			pose.chassis.s[12], pose.chassis.s[13], pose.chassis.s[14]);
+	}
+
+	long total = steps * n;
+	printf("# %d configs x %ld steps on %d threads in %.3fs: %.0f steps/s\n",
+		n,
+		steps,
+		sim_pool_thread_count(pool),
+		elapsed,
+		(double)total / elapsed);
+
+	free(tunings);
+	sim_pool_free(pool);
+}
+
+int main(int argc, char** argv)
+{
+	struct script script;
+	memset(&script, 0, sizeof(struct script));
+
+	int hz = 0;
+	int repeat = 1;
+	int sweep = 0;
+	int n_threads = 0;
+	int n_vehicles = 1;
+	int sim_threads = 1;
+	int scaling = 0;
+	int rewind = 0;
+	int reset = 0;
+	int lite = 0;
+	int nostream = 0;
+	int quality = -1;
+	const char* record_path = NULL;
+	const char* play_path = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-hz") == 0 && i+1 < argc) {
+			hz = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-repeat") == 0 && i+1 < argc) {
+			repeat = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-sweep") == 0 && i+1 < argc) {
+			sweep = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-threads") == 0 && i+1 < argc) {
+			n_threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-vehicles") == 0 && i+1 < argc) {
+			n_vehicles = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-j") == 0 && i+1 < argc) {
+			sim_threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-scaling") == 0 && i+1 < argc) {
+			scaling = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-record") == 0 && i+1 < argc) {
+			record_path = argv[++i];
+		} else if (strcmp(argv[i], "-play") == 0 && i+1 < argc) {
+			play_path = argv[++i];
+		} else if (strcmp(argv[i], "-quality") == 0 && i+1 < argc) {
+			i++;
+			quality = sim_quality_from_name(argv[i]);
+			if (quality == -1) arghf("unknown quality: %s\n", argv[i]);
+		} else if (strcmp(argv[i], "-rewind") == 0) {
+			rewind = 1;
+		} else if (strcmp(argv[i], "-reset") == 0) {
+			reset = 1;
+		} else if (strcmp(argv[i], "-lite") == 0) {
+			lite = 1;
+		} else if (strcmp(argv[i], "-nostream") == 0) {
+			nostream = 1;
+		} else if (strcmp(argv[i], "-scheduler") == 0 && i+1 < argc) {
+			i++;
+			if (!sim_set_task_scheduler(argv[i])) arghf("task scheduler not available: %s\n", argv[i]);
+		} else if (argv[i][0] != '-') {
+			script_load(&script, argv[i]);
+		} else {
+			arghf("usage: %s [-hz <rate>] [-repeat <n>] [-sweep <n>] [-threads <n>] [-vehicles <n>] [-j <n>] [-scaling <n>] [-scheduler <name>] [-quality <tier>] [-lite] [-nostream] [-rewind] [-reset] [-record <file>] [-play <file>] [script]\n", argv[0]);
+		}
+	}
+	if (script.n == 0) script_init_demo(&script);
+	// replays always come back with full vehicles
+	if (lite && record_path != NULL) arghf("-lite can't be recorded\n");
+	if (quality >= 0 && play_path != NULL) arghf("-play takes the quality from the replay\n");
+	if (nostream && (play_path != NULL || sweep > 0 || scaling > 0)) arghf("-nostream only goes with a single sim\n");
+
+	// XXX there's no track file format yet
+	static struct track track;
+	track_init_demo(&track);
+
+	if (play_path != NULL) {
+		run_play(&track, play_path, sim_threads);
+		return 0;
+	}
+
+	if (sweep > 0) {
+		run_sweep(&track, &script, repeat, sweep, n_threads, hz);
+		return 0;
+	}
+
+	if (scaling > 0) {
+		run_scaling(&track, &script, repeat, scaling, n_vehicles, hz);
+		return 0;
+	}
+
+	struct game game;
+	if (nostream) {
+		game_init_nostream(&game, &track, sim_threads);
+	} else {
+		game_init(&game, &track, sim_threads);
+	}
+	if (quality >= 0) sim_set_quality(game.sim, quality);
+	if (hz > 0) sim_set_step_rate(game.sim, hz);
+	add_vehicles(game.sim, n_vehicles, lite);
+	n_vehicles = sim_vehicle_count(game.sim);
+
+	if (rewind) {
+		run_rewind(game.sim, &script, repeat);
+		game_free(&game);
+		return 0;
+	}
+
+	if (reset) {
+		run_reset(game.sim, &script, repeat, lite);
+		game_free(&game);
+		return 0;
+	}
+
+	struct replay_recorder recorder;
+	if (record_path != NULL) replay_recorder_open(&recorder, record_path, &track, game.sim, n_vehicles);
+
+	double t0 = seconds();
+	long steps = run_script(game.sim, &script, repeat, record_path != NULL ? &recorder : NULL);
+	double elapsed = seconds() - t0;
+
+	if (record_path != NULL) replay_recorder_close(&recorder, game.sim);
+
+	double sim_time = (double)steps * (double)sim_get_step_dt(game.sim);
+	printf("%ld steps x %d vehicles (%.1fs sim time) in %.3fs: %.0f steps/s, %.1fx realtime\n",
+		steps,
+		n_vehicles,
+		sim_time,
+		elapsed,
+		(double)steps / elapsed,
+		sim_time / elapsed);
+
+	struct sim_vehicle_pose pose;
+	sim_vehicle_get_pose(sim_get_vehicle(game.sim, 0), &pose);
+	printf("final chassis position: ");
+	struct vec3 position = {{pose.chassis.s[12], pose.chassis.s[13], pose.chassis.s[14]}};
+	vec3_dump(&position);
+
+	game_print_stats(&game);
+	game_free(&game);
+
+	return 0;
+}
@@ -2,6 +2,8 @@
 #include <GL/glew.h>
 
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 
 #include "sim.h"
 #include "a.h"
@@ -9,6 +11,7 @@
 #include "track.h"
 #include "editor.h"
 #include "game.h"
+#include "replay.h"
 
 void glew_init()
 {
@@ -68,13 +71,75 @@ int main(int argc, char** argv)
 	editor_init(&editor);
 	editor_run(&editor, &render, &track);
 	#else
-	SDL_DisplayMode mode;
-	SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode);
-	float dt = 1.0f / (float)mode.refresh_rate;
+	int threaded_sim = 0;
+	int hz = 0;
+	double budget = -1;
+	const char* quality = NULL;
+	int sim_threads = 1;
+	const char* record_path = NULL;
+	const char* play_path = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-t") == 0) {
+			// physics on its own thread
+			threaded_sim = 1;
+		} else if (strcmp(argv[i], "-hz") == 0 && i+1 < argc) {
+			// physics step rate; independent of the display
+			hz = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-budget") == 0 && i+1 < argc) {
+			// ms of physics per frame; 0 for no limit
+			budget = atof(argv[++i]) * 1e-3;
+		} else if (strcmp(argv[i], "-quality") == 0 && i+1 < argc) {
+			// low, medium, high, ultra or auto
+			quality = argv[++i];
+		} else if (strcmp(argv[i], "-j") == 0 && i+1 < argc) {
+			// Bullet worker threads (SIM_MT builds)
+			sim_threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-record") == 0 && i+1 < argc) {
+			record_path = argv[++i];
+		} else if (strcmp(argv[i], "-play") == 0 && i+1 < argc) {
+			// real time, rendered; see headless for fast playback
+			play_path = argv[++i];
+		} else if (strcmp(argv[i], "-scheduler") == 0 && i+1 < argc) {
+			i++;
+			if (!sim_set_task_scheduler(argv[i])) arghf("task scheduler not available: %s\n", argv[i]);
+		} else {
+			arghf("unknown argument: %s\n", argv[i]);
+		}
+	}
+
 	struct game game;
-	game_init(&game, dt, &track);
+	game_init(&game, &track, sim_threads);
+	game.threaded_sim = threaded_sim;
+	if (quality != NULL) {
+		if (strcmp(quality, "auto") == 0) {
+			if (record_path != NULL || play_path != NULL) arghf("-quality auto doesn't work with -record/-play\n");
+			sim_set_quality_auto(game.sim, 1);
+		} else {
+			int q = sim_quality_from_name(quality);
+			if (q == -1) arghf("unknown quality: %s\n", quality);
+			if (play_path != NULL) arghf("-play takes the quality from the replay\n");
+			sim_set_quality(game.sim, q);
+		}
+	}
+	if (hz > 0) sim_set_step_rate(game.sim, hz);
+	if (budget >= 0) sim_set_step_budget(game.sim, budget);
+
+	if ((record_path != NULL || play_path != NULL) && threaded_sim) {
+		arghf("-record/-play don't work with -t\n");
+	}
+	static struct replay_recorder recorder;
+	static struct replay_player player;
+	if (record_path != NULL) {
+		replay_recorder_open(&recorder, record_path, &track, game.sim, 1);
+		game.recorder = &recorder;
+	} else if (play_path != NULL) {
+		replay_player_open(&player, play_path);
+		replay_player_begin(&player, &track, game.sim);
+		game.player = &player;
+	}
 
 	game_run(&game, &render);
+	game_free(&game);
 	#endif
 
 	SDL_DestroyWindow(window);
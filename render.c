@@ -1,14 +1,17 @@
 #include <GL/glew.h>
+#include <stdio.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 #include "render.h"
 #include "magic.h"
 #include "a.h"
 #include "m.h"
 
+// vertex shaders get u_projection and u_view from struct shader_camera
 static const char* road_shader_vertex_src =
 	"#version 130\n"
-	"uniform mat4 u_projection;\n"
-	"uniform mat4 u_view;\n"
 	"\n"
 	"attribute vec3 a_position;\n"
 	"attribute vec3 a_normal;\n"
@@ -46,8 +49,6 @@ static const char* road_shader_fragment_src =
 
 static const char* color_shader_vertex_src =
 	"#version 130\n"
-	"uniform mat4 u_projection;\n"
-	"uniform mat4 u_view;\n"
 	"\n"
 	"attribute vec3 a_position;\n"
 	"attribute vec4 a_color;\n"
@@ -71,10 +72,103 @@ static const char* color_shader_fragment_src =
 	"}\n";
 
 
+/* same look as the road shader, but the model transform comes per instance
+ * from the sim's transform buffer (see struct sim_transforms) */
+static const char* instanced_shader_vertex_src =
+	"#version 130\n"
+	"uniform vec3 u_scale;\n"
+	"\n"
+	"attribute vec3 a_position;\n"
+	"attribute vec3 a_normal;\n"
+	"attribute float a_material;\n"
+	"attribute vec4 a_model0;\n"
+	"attribute vec4 a_model1;\n"
+	"attribute vec4 a_model2;\n"
+	"attribute vec4 a_model3;\n"
+	"\n"
+	"varying vec3 v_position;\n"
+	"varying vec3 v_normal;\n"
+	"varying float v_material;\n"
+	"\n"
+	"void main()\n"
+	"{\n"
+	"	mat4 model = mat4(a_model0, a_model1, a_model2, a_model3);\n"
+	"	vec4 p = model * vec4(a_position * u_scale, 1);\n"
+	"	v_position = p.xyz;\n"
+	"	v_normal = mat3(model) * a_normal;\n"
+	"	v_material = a_material;\n"
+	"	gl_Position = u_projection * u_view * p;\n"
+	"}\n";
+
+
+/* the road straight from each node's four derived track points, one
+ * instance per node; the same blocks as track_points_construct_block(),
+ * 18 vertices (3 quads as triangles: top, left and right skirt) each,
+ * u_subdiv of them per node; that's the level of detail */
+static const char* road_gpu_shader_vertex_src =
+	"#version 130\n"
+	"uniform float u_subdiv;\n"
+	"\n"
+	"attribute vec4 a_point0;\n"
+	"attribute vec4 a_point1;\n"
+	"attribute vec4 a_point2;\n"
+	"attribute vec4 a_point3;\n"
+	"attribute vec3 a_normal0;\n"
+	"attribute vec3 a_normal1;\n"
+	"attribute vec3 a_normal2;\n"
+	"attribute vec3 a_normal3;\n"
+	"\n"
+	"varying vec3 v_position;\n"
+	"varying vec3 v_normal;\n"
+	"varying float v_material;\n"
+	"\n"
+	"const int quad_corner[6] = int[6](0, 1, 2, 0, 2, 3);\n"
+	"// block points 0-3 on the road, 4-7 the same on the ground\n"
+	"const int quad_point[12] = int[12](0, 1, 2, 3, 0, 3, 7, 4, 2, 1, 5, 6);\n"
+	"\n"
+	"vec4 bezier_weights(float t)\n"
+	"{\n"
+	"	float s = 1.0 - t;\n"
+	"	return vec4(s*s*s, 3.0*s*s*t, 3.0*s*t*t, t*t*t);\n"
+	"}\n"
+	"\n"
+	"// same as calc_bezier_deriv(), 3x on the last term and all\n"
+	"vec4 bezier_deriv_weights(float t)\n"
+	"{\n"
+	"	float s = 1.0 - t;\n"
+	"	return vec4(-3.0*s*s, 3.0*s*s - 6.0*s*t, 6.0*s*t - 9.0*t*t, 9.0*t*t);\n"
+	"}\n"
+	"\n"
+	"void main()\n"
+	"{\n"
+	"	int block = gl_VertexID / 18;\n"
+	"	int quad = (gl_VertexID / 6) % 3;\n"
+	"	int point = quad_point[quad*4 + quad_corner[gl_VertexID % 6]];\n"
+	"	int end = (point & 3) >= 2 ? 1 : 0;\n"
+	"	float side = ((point & 3) == 0 || (point & 3) == 3) ? -1.0 : 1.0;\n"
+	"\n"
+	"	float t = float(block + end) / u_subdiv;\n"
+	"	vec4 w = bezier_weights(t);\n"
+	"	vec4 dw = bezier_deriv_weights(t);\n"
+	"	vec3 p = w.x*a_point0.xyz + w.y*a_point1.xyz + w.z*a_point2.xyz + w.w*a_point3.xyz;\n"
+	"	vec3 d = dw.x*a_point0.xyz + dw.y*a_point1.xyz + dw.z*a_point2.xyz + dw.w*a_point3.xyz;\n"
+	"	vec3 n = w.x*a_normal0 + w.y*a_normal1 + w.z*a_normal2 + w.w*a_normal3;\n"
+	"	float width = dot(w, vec4(a_point0.w, a_point1.w, a_point2.w, a_point3.w));\n"
+	"	vec3 r = normalize(cross(d, n));\n"
+	"	n = normalize(cross(r, d));\n"
+	"\n"
+	"	vec3 position = p + r * (width * side);\n"
+	"	if (point >= 4) position.y = 0.0;\n"
+	"	vec3 skirt = normalize(vec3(r.x, 0.0, r.z));\n"
+	"	v_normal = quad == 0 ? n : (quad == 1 ? skirt : -skirt);\n"
+	"	v_material = quad == 0 ? 0.5 : 1.5;\n"
+	"	v_position = position;\n"
+	"	gl_Position = u_projection * u_view * vec4(position, 1);\n"
+	"}\n";
+
+
 static const char* horizon_vertex_shader_src =
 	"#version 130\n"
-	"uniform mat4 u_projection;\n"
-	"uniform mat4 u_view;\n"
 	"\n"
 	"attribute vec3 a_position;\n"
 	"\n"
@@ -143,9 +237,185 @@ static void render_init_horizon(struct render_horizon* h)
 	}
 
 	{
-		shader_init(&h->shader, horizon_vertex_shader_src, horizon_fragment_shader_src);
-		h->apos = glGetAttribLocation(h->shader.program, "a_position"); CHKGL;
+		static const char* attribs[] = {"a_position", NULL};
+		shader_init(&h->shader, horizon_vertex_shader_src, horizon_fragment_shader_src, attribs);
+		h->apos = 0;
+	}
+}
+
+static void _circle_point(int i, int N, float radius, float* x, float* y)
+{
+	float phi = I2RAD((float)(i%N) / (float)N);
+	*x = cosf(phi) * radius;
+	*y = sinf(phi) * radius;
+}
+
+static void _mesh_add_vertex(float** p, struct vec3* position, struct vec3* normal, float material)
+{
+	for (int i = 0; i < 3; i++) *((*p)++) = position->s[i];
+	for (int i = 0; i < 3; i++) *((*p)++) = normal->s[i];
+	*((*p)++) = material;
+}
+
+static GLuint _mesh_upload(float* data, int n_vertices)
+{
+	GLuint buffer;
+	glGenBuffers(1, &buffer); CHKGL;
+	glBindBuffer(GL_ARRAY_BUFFER, buffer); CHKGL;
+	glBufferData(GL_ARRAY_BUFFER, n_vertices * RENDER_MESH_FLOATS * sizeof(float), data, GL_STATIC_DRAW); CHKGL;
+	return buffer;
+}
+
+// unit box; same faces as render_box()
+static void render_init_box_mesh(struct render_instanced* ri)
+{
+	ri->box_n_vertices = 6 * 6;
+	float* data = malloc(ri->box_n_vertices * RENDER_MESH_FLOATS * sizeof(float));
+	AN(data);
+	float* p = data;
+	for (int i = 0; i < 3; i++) {
+		int ap = 1<<i;
+		for (int j = 0; j < 2; j++) {
+			struct vec3 ps[4];
+			int psi = 0;
+			for (int k = 0; k < 8; k++) {
+				if ((k&ap) == (ap*j)) {
+					struct vec3 v = {{k&1 ? 1 : -1, k&2 ? 1 : -1, k&4 ? 1 : -1}};
+					vec3_copy(&ps[psi++], &v);
+				}
+			}
+			ASSERT(psi == 4);
+			struct vec3 n = {{
+				i == 0 ? (j == 0 ? 1 : -1) : 0,
+				i == 1 ? (j == 0 ? 1 : -1) : 0,
+				i == 2 ? (j == 0 ? 1 : -1) : 0
+			}};
+			float mat = 1.5;
+			int quad[6] = {0, 1, 3, 0, 3, 2};
+			for (int q = 0; q < 6; q++) _mesh_add_vertex(&p, &ps[quad[q]], &n, mat);
+		}
 	}
+	ASSERT(p - data == ri->box_n_vertices * RENDER_MESH_FLOATS);
+	ri->box_buffer = _mesh_upload(data, ri->box_n_vertices);
+	free(data);
+}
+
+// unit wheel around the x axis; same as render_a_wheel()
+static void render_init_wheel_mesh(struct render_instanced* ri)
+{
+	int N = 32;
+	ri->wheel_n_vertices = N * 6;
+	float* data = malloc(ri->wheel_n_vertices * RENDER_MESH_FLOATS * sizeof(float));
+	AN(data);
+	float* p = data;
+	for (int i = 0; i < N; i++) {
+		struct vec3 ps[4];
+		for (int j = 0; j < 4; j++) {
+			float x, y;
+			_circle_point(i + (j == 1 || j == 2 ? 1 : 0), N, 1, &x, &y);
+			struct vec3 v = {{j < 2 ? -1 : 1, x, y}};
+			vec3_copy(&ps[j], &v);
+		}
+		float mat = (i&3) ? 2.5 : 0.5;
+		struct vec3 n;
+		vec3_calculate_normal_from_3_points(&n, ps);
+		int quad[6] = {0, 1, 2, 0, 2, 3};
+		for (int q = 0; q < 6; q++) _mesh_add_vertex(&p, &ps[quad[q]], &n, mat);
+	}
+	ASSERT(p - data == ri->wheel_n_vertices * RENDER_MESH_FLOATS);
+	ri->wheel_buffer = _mesh_upload(data, ri->wheel_n_vertices);
+	free(data);
+}
+
+static void render_init_instanced(struct render_instanced* ri)
+{
+	ri->enabled = GLEW_ARB_instanced_arrays && GLEW_ARB_draw_instanced;
+	if (!ri->enabled) return;
+
+	static const char* attribs[] = {
+		"a_position", "a_normal", "a_material",
+		"a_model0", "a_model1", "a_model2", "a_model3",
+		NULL
+	};
+	shader_init(&ri->shader, instanced_shader_vertex_src, road_shader_fragment_src, attribs);
+	ri->u_scale = glGetUniformLocation(ri->shader.program, "u_scale"); CHKGL;
+	ri->a_position = 0;
+	ri->a_normal = 1;
+	ri->a_material = 2;
+	for (int c = 0; c < 4; c++) ri->a_model[c] = 3 + c;
+
+	render_init_box_mesh(ri);
+	render_init_wheel_mesh(ri);
+
+	glGenBuffers(1, &ri->instance_buffer); CHKGL;
+}
+
+// 3 quads per block, as triangles
+#define ROAD_BLOCK_VERTICES (3 * 6)
+
+/* road levels of detail: level l has BEZIER_SUBDIV>>l blocks per node.
+ * neighbours on different levels don't crack; a node's end cross section
+ * is the next node's start (same point, tangent, normal and width), and
+ * the road is only one quad across, so there's no t-junction to stitch */
+#define ROAD_LOD_LEVELS (5)
+#define ROAD_LOD_BLOCKS(l) (BEZIER_SUBDIV >> (l))
+// blocks in the levels before l; 32+16+8+... sums to twice the first less twice the last
+#define ROAD_LOD_OFFSET(l) (2 * (BEZIER_SUBDIV - ROAD_LOD_BLOCKS(l)))
+#define ROAD_LOD_PIXELS (0.75f) // allowed chord error, on screen
+#define ROAD_LOD_NEAR (1.0f)
+
+#if ROAD_LOD_BLOCKS(ROAD_LOD_LEVELS - 1) < 2
+#error "BEZIER_SUBDIV too small for ROAD_LOD_LEVELS"
+#endif
+
+// a slot holds every level
+#define ROAD_SLOT_VERTICES (ROAD_LOD_OFFSET(ROAD_LOD_LEVELS) * ROAD_BLOCK_VERTICES)
+#define ROAD_SLOT_FLOATS (ROAD_SLOT_VERTICES * RENDER_MESH_FLOATS)
+
+enum road_slot_state {
+	ROAD_SLOT_STALE = 0,
+	ROAD_SLOT_BUILT,
+	ROAD_SLOT_EMPTY // no next node; all zeros, so nothing is drawn
+};
+
+// position and width, then the normal, for each of the 4 points
+#define ROAD_NODE_FLOATS (4 * 4 + 4 * 3)
+
+static void render_init_road_gpu(struct render_road_gpu* rg, int enabled)
+{
+	rg->enabled = enabled;
+	if (!rg->enabled) return;
+
+	static const char* attribs[] = {
+		"a_point0", "a_point1", "a_point2", "a_point3",
+		"a_normal0", "a_normal1", "a_normal2", "a_normal3",
+		NULL
+	};
+	shader_init(&rg->shader, road_gpu_shader_vertex_src, road_shader_fragment_src, attribs);
+	rg->u_subdiv = glGetUniformLocation(rg->shader.program, "u_subdiv"); CHKGL;
+	for (int i = 0; i < 4; i++) {
+		rg->a_point[i] = i;
+		rg->a_normal[i] = 4 + i;
+	}
+
+	glGenBuffers(1, &rg->instance_buffer); CHKGL;
+	rg->data = NULL;
+	rg->node = NULL;
+	rg->uploaded = NULL;
+	rg->cap = 0;
+	rg->n_uploaded = 0;
+}
+
+static void render_init_road_cache(struct render_road_cache* rc)
+{
+	glGenBuffers(1, &rc->vertex_buffer); CHKGL;
+	rc->cap = 0;
+	rc->built = NULL;
+	rc->state = NULL;
+	rc->first = NULL;
+	rc->count = NULL;
+	rc->scratch = malloc(ROAD_SLOT_FLOATS * sizeof(float));
+	AN(rc->scratch);
 }
 
 void render_init(struct render* render, SDL_Window* window)
@@ -167,6 +437,7 @@ void render_init(struct render* render, SDL_Window* window)
 	mat44_set_identity(&render->view);
 
 	dbuf_init(&render->dbuf, 1<<16, 1<<14);
+	shader_camera_init(&render->camera);
 
 	// road dtype
 	static struct dtype_attr_spec road_specs[] = {
@@ -178,6 +449,7 @@ void render_init(struct render* render, SDL_Window* window)
 	dtype_init(
 		&render->road_dtype,
 		&render->dbuf,
+		&render->camera,
 		road_shader_vertex_src,
 		road_shader_fragment_src,
 		road_specs
@@ -192,12 +464,27 @@ void render_init(struct render* render, SDL_Window* window)
 	dtype_init(
 		&render->color_dtype,
 		&render->dbuf,
+		&render->camera,
 		color_shader_vertex_src,
 		color_shader_fragment_src,
 		color_specs
 	);
 
 	render_init_horizon(&render->horizon);
+	render_init_instanced(&render->instanced);
+	render_init_road_cache(&render->road_cache);
+	render_init_road_gpu(&render->road_gpu, render->instanced.enabled);
+
+	render->node_visible = malloc(TRACK_NODE_MAX);
+	AN(render->node_visible);
+	render->node_lod = malloc(TRACK_NODE_MAX);
+	AN(render->node_lod);
+}
+
+// the camera for whatever is drawn next; only reaches the gpu if it changed
+static void render_camera(struct render* render)
+{
+	shader_camera_set(&render->camera, &render->projection, &render->view);
 }
 
 static void gl_viewport_from_sdl_window(SDL_Window* window)
@@ -232,66 +519,325 @@ static void _color_add_vertex(struct render* render, struct vec3* position, stru
 	}
 }
 
-static void render_road_node_bezier(struct render* render, struct track* track, struct track_node_bezier* bz)
+// a quad as two triangles, in dtype_new_quad() order
+static void _road_add_quad(float** p, struct vec3** ps, struct vec3** ns, float material)
 {
-	struct track_point tps[4];
-	if (!track_node_bezier_derive_4_track_points(track, bz, tps)) return;
-
-	int N = BEZIER_SUBDIV;
+	int quad[6] = {0, 1, 2, 0, 2, 3};
+	for (int q = 0; q < 6; q++) _mesh_add_vertex(p, ps[quad[q]], ns[quad[q]], material);
+}
 
+// N blocks along one node's road
+static void _road_add_blocks(float** p, struct track_point* tps, int N)
+{
 	for (int i = 0; i < N; i++) {
 
 		struct vec3 points[8];
 		struct vec3 normals[6];
 		track_points_construct_block(tps, i, N, points, normals);
 
-		dtype_new_quad(&render->road_dtype);
 		float mflat = 0.5f;
-		for (int i = 0; i < 4; i++) {
-			_road_add_vertex(render, &points[i], &normals[i < 2 ? 0 : 1], mflat);
-		}
+		struct vec3* flat_ps[4] = {&points[0], &points[1], &points[2], &points[3]};
+		struct vec3* flat_ns[4] = {&normals[0], &normals[0], &normals[1], &normals[1]};
+		_road_add_quad(p, flat_ps, flat_ns, mflat);
 
 		float mside = 1.5f;
-		dtype_new_quad(&render->road_dtype);
-		_road_add_vertex(render, &points[0], &normals[2], mside);
-		_road_add_vertex(render, &points[3], &normals[3], mside);
-		_road_add_vertex(render, &points[7], &normals[3], mside);
-		_road_add_vertex(render, &points[4], &normals[2], mside);
+		struct vec3* left_ps[4] = {&points[0], &points[3], &points[7], &points[4]};
+		struct vec3* left_ns[4] = {&normals[2], &normals[3], &normals[3], &normals[2]};
+		_road_add_quad(p, left_ps, left_ns, mside);
 
-		dtype_new_quad(&render->road_dtype);
-		_road_add_vertex(render, &points[2], &normals[5], mside);
-		_road_add_vertex(render, &points[1], &normals[4], mside);
-		_road_add_vertex(render, &points[5], &normals[4], mside);
-		_road_add_vertex(render, &points[6], &normals[5], mside);
+		struct vec3* right_ps[4] = {&points[2], &points[1], &points[5], &points[6]};
+		struct vec3* right_ns[4] = {&normals[5], &normals[4], &normals[4], &normals[5]};
+		_road_add_quad(p, right_ps, right_ns, mside);
 	}
 }
 
-static void render_road_nodes(struct render* render, struct track* track)
+// one node's road into a slot, every level; tps from track_node_bezier_derive_4_track_points()
+static void render_road_node_bezier(float* data, struct track_point* tps)
 {
+	float* p = data;
+	for (int level = 0; level < ROAD_LOD_LEVELS; level++) {
+		ASSERT(p - data == ROAD_LOD_OFFSET(level) * ROAD_BLOCK_VERTICES * RENDER_MESH_FLOATS);
+		_road_add_blocks(&p, tps, ROAD_LOD_BLOCKS(level));
+	}
+	ASSERT(p - data == ROAD_SLOT_FLOATS);
+}
+
+// what the geometry depends on; flags (hover, selection) don't count
+static int _road_points_equal(struct track_point* a, struct track_point* b)
+{
+	for (int i = 0; i < 4; i++) {
+		if (memcmp(&a[i].position, &b[i].position, sizeof(struct vec3)) != 0) return 0;
+		if (memcmp(&a[i].normal, &b[i].normal, sizeof(struct vec3)) != 0) return 0;
+		if (a[i].width != b[i].width) return 0;
+	}
+	return 1;
+}
+
+static void _road_cache_reserve(struct render_road_cache* rc, int n)
+{
+	if (n <= rc->cap) return;
+	int cap = rc->cap ? rc->cap : 64;
+	while (cap < n) cap *= 2;
+	rc->built = realloc(rc->built, cap * 4 * sizeof(struct track_point));
+	AN(rc->built);
+	rc->state = realloc(rc->state, cap * sizeof(int));
+	AN(rc->state);
+	rc->first = realloc(rc->first, cap * sizeof(GLint));
+	AN(rc->first);
+	rc->count = realloc(rc->count, cap * sizeof(GLsizei));
+	AN(rc->count);
+	// a new buffer, so every slot goes up again
+	for (int i = 0; i < cap; i++) rc->state[i] = ROAD_SLOT_STALE;
+	glBindBuffer(GL_ARRAY_BUFFER, rc->vertex_buffer); CHKGL;
+	glBufferData(GL_ARRAY_BUFFER, (size_t)cap * ROAD_SLOT_FLOATS * sizeof(float), NULL, GL_STATIC_DRAW); CHKGL;
+	rc->cap = cap;
+}
+
+/* sets node_lod for the visible nodes: the fewest blocks whose chord error
+ * stays under ROAD_LOD_PIXELS on screen. with n blocks a cubic strays at
+ * most 3/4*bend/n^2 from its chords, so straight or far nodes get few and
+ * tight close ones keep all BEZIER_SUBDIV. distance is to the node's
+ * bounding sphere, so it errs towards more blocks */
+static void render_road_lod(struct render* render, struct track* track)
+{
+	int width, height;
+	SDL_GetWindowSize(render->window, &width, &height);
+	float pixels = render->projection.s[5] * (float)height * 0.5f; // per unit at distance 1
+
+	struct track_bounds* b = &track->bounds;
+	render->road_slices = 0;
+	for (int i = 0; i < track->node_count; i++) {
+		if (!render->node_visible[i]) continue;
+		struct vec3 c = {{b->cx[i], b->cy[i], b->cz[i]}};
+		struct vec3 cv;
+		vec3_apply_mat44(&cv, &c, &render->view);
+		float radius = sqrtf(b->ex[i]*b->ex[i] + b->ey[i]*b->ey[i] + b->ez[i]*b->ez[i]);
+		float distance = sqrtf(vec3_dot(&cv, &cv)) - radius;
+		if (distance < ROAD_LOD_NEAR) distance = ROAD_LOD_NEAR;
+		float error = 0.75f * b->bend[i] * pixels / distance;
+
+		int level = ROAD_LOD_LEVELS - 1;
+		while (level > 0) {
+			float n = (float)ROAD_LOD_BLOCKS(level);
+			if (error <= ROAD_LOD_PIXELS * n * n) break;
+			level--;
+		}
+		render->node_lod[i] = level;
+		render->road_slices += ROAD_LOD_BLOCKS(level);
+	}
+}
+
+/* per frame this is O(nodes): derive each node's points, and upload them
+ * only if anything changed since the last frame */
+static void render_road_gpu(struct render* render, struct track* track)
+{
+	struct render_road_gpu* rg = &render->road_gpu;
+	if (track->node_count > rg->cap) {
+		rg->cap = track->node_count;
+		rg->data = realloc(rg->data, rg->cap * ROAD_NODE_FLOATS * sizeof(float));
+		AN(rg->data);
+		rg->node = realloc(rg->node, rg->cap * sizeof(int));
+		AN(rg->node);
+		rg->uploaded = realloc(rg->uploaded, rg->cap * ROAD_NODE_FLOATS * sizeof(float));
+		AN(rg->uploaded);
+		rg->n_uploaded = -1;
+	}
+
+	int n = 0;
 	for (int i = 0; i < track->node_count; i++) {
 		struct track_node* node = track_get_node(track, i);
-		switch (node->type) {
-			case TRACK_BEZIER:
-				render_road_node_bezier(render, track, &node->bezier);
-				break;
-			case TRACK_DELETED: arghf("encountered TRACK_DELETED");
-				break;
+		if (node->type == TRACK_DELETED) arghf("encountered TRACK_DELETED");
+		struct track_point tps[4];
+		if (!track_node_bezier_derive_4_track_points(track, &node->bezier, tps)) continue;
+		rg->node[n] = i;
+		float* p = &rg->data[n++ * ROAD_NODE_FLOATS];
+		for (int j = 0; j < 4; j++) {
+			for (int k = 0; k < 3; k++) *(p++) = tps[j].position.s[k];
+			*(p++) = tps[j].width;
+		}
+		for (int j = 0; j < 4; j++) {
+			for (int k = 0; k < 3; k++) *(p++) = tps[j].normal.s[k];
 		}
 	}
+
+	size_t sz = (size_t)n * ROAD_NODE_FLOATS * sizeof(float);
+	glBindBuffer(GL_ARRAY_BUFFER, rg->instance_buffer); CHKGL;
+	if (n != rg->n_uploaded || memcmp(rg->data, rg->uploaded, sz) != 0) {
+		glBufferData(GL_ARRAY_BUFFER, sz, rg->data, GL_STATIC_DRAW); CHKGL;
+		memcpy(rg->uploaded, rg->data, sz);
+		rg->n_uploaded = n;
+	}
+	if (n == 0) return;
+
+	render_camera(render);
+	shader_use(&rg->shader, &render->camera);
+
+	for (int j = 0; j < 4; j++) {
+		glEnableVertexAttribArray(rg->a_point[j]);
+		glVertexAttribDivisorARB(rg->a_point[j], 1);
+		glEnableVertexAttribArray(rg->a_normal[j]);
+		glVertexAttribDivisorARB(rg->a_normal[j], 1);
+	}
+	CHKGL;
+
+	/* the buffer holds every node, so it survives camera moves; culling
+	 * and levels of detail draw runs of visible instances on the same
+	 * level by offsetting the attribute pointers (base instance needs GL
+	 * 4.2) */
+	size_t stride = ROAD_NODE_FLOATS * sizeof(float);
+	uint8_t* visible = render->node_visible;
+	uint8_t* lod = render->node_lod;
+	for (int k = 0; k < n; ) {
+		if (!visible[rg->node[k]]) {
+			k++;
+			continue;
+		}
+		int first = k;
+		int level = lod[rg->node[k]];
+		while (k < n && visible[rg->node[k]] && lod[rg->node[k]] == level) k++;
+		char* base = (char*)((size_t)first * stride);
+		for (int j = 0; j < 4; j++) {
+			glVertexAttribPointer(rg->a_point[j], 4, GL_FLOAT, GL_FALSE, stride, base + j * 4 * sizeof(float));
+			glVertexAttribPointer(rg->a_normal[j], 3, GL_FLOAT, GL_FALSE, stride, base + (16 + j * 3) * sizeof(float));
+		}
+		CHKGL;
+		int blocks = ROAD_LOD_BLOCKS(level);
+		glUniform1f(rg->u_subdiv, (float)blocks);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, blocks * ROAD_BLOCK_VERTICES, k - first); CHKGL;
+	}
+
+	for (int j = 0; j < 4; j++) {
+		glVertexAttribDivisorARB(rg->a_point[j], 0);
+		glDisableVertexAttribArray(rg->a_point[j]);
+		glVertexAttribDivisorARB(rg->a_normal[j], 0);
+		glDisableVertexAttribArray(rg->a_normal[j]);
+	}
+	CHKGL;
+
+	glUseProgram(0); CHKGL;
 }
 
+/* a node's slot depends on its own points and on the next node's first
+ * two (see track_node_bezier_derive_4_track_points()), so comparing the
+ * derived points catches edits to either; that's all the steady state
+ * costs per node. culled slots are left stale until they come into view,
+ * and slots past node_count are just not drawn */
 static void render_road(struct render* render, struct track* track)
 {
-	dtype_begin(&render->road_dtype);
+	render_road_lod(render, track);
+
+	if (render->road_gpu.enabled) {
+		render_road_gpu(render, track);
+		return;
+	}
+
+	struct render_road_cache* rc = &render->road_cache;
+	_road_cache_reserve(rc, track->node_count);
+
+	glBindBuffer(GL_ARRAY_BUFFER, rc->vertex_buffer); CHKGL;
+	size_t slot_sz = ROAD_SLOT_FLOATS * sizeof(float);
+	rc->rebuilt = 0;
+	uint8_t* visible = render->node_visible;
+	for (int i = 0; i < track->node_count; i++) {
+		if (!visible[i]) continue;
+		struct track_node* node = track_get_node(track, i);
+		if (node->type == TRACK_DELETED) arghf("encountered TRACK_DELETED");
+
+		struct track_point tps[4];
+		int state = track_node_bezier_derive_4_track_points(track, &node->bezier, tps) ? ROAD_SLOT_BUILT : ROAD_SLOT_EMPTY;
+		struct track_point* built = &rc->built[i*4];
+		if (state == rc->state[i] && (state == ROAD_SLOT_EMPTY || _road_points_equal(built, tps))) continue;
+
+		if (state == ROAD_SLOT_BUILT) {
+			render_road_node_bezier(rc->scratch, tps);
+			memcpy(built, tps, 4 * sizeof(struct track_point));
+		} else {
+			memset(rc->scratch, 0, slot_sz);
+		}
+		glBufferSubData(GL_ARRAY_BUFFER, (size_t)i * slot_sz, slot_sz, rc->scratch); CHKGL;
+		rc->state[i] = state;
+		rc->rebuilt++;
+	}
 
-	dtype_set_matrix(&render->road_dtype, "u_projection", &render->projection);
-	dtype_set_matrix(&render->road_dtype, "u_view", &render->view);
+	render_camera(render);
+	dtype_begin(&render->road_dtype);
 
-	render_road_nodes(render, track);
+	int n = 0;
+	for (int i = 0; i < track->node_count; i++) {
+		if (!visible[i] || rc->state[i] != ROAD_SLOT_BUILT) continue;
+		int level = render->node_lod[i];
+		rc->first[n] = i * ROAD_SLOT_VERTICES + ROAD_LOD_OFFSET(level) * ROAD_BLOCK_VERTICES;
+		rc->count[n] = ROAD_LOD_BLOCKS(level) * ROAD_BLOCK_VERTICES;
+		n++;
+	}
+	dtype_multi_draw_arrays(&render->road_dtype, rc->vertex_buffer, GL_TRIANGLES, rc->first, rc->count, n);
 
 	dtype_end(&render->road_dtype);
 }
 
+/* tests the track's node bounds against the frustum planes of
+ * projection*view, four nodes at a time; a box is out when it's entirely
+ * behind any one plane. planes aren't normalized, the test doesn't care */
+static void render_cull_nodes(struct render* render, struct track* track)
+{
+	track_update_bounds(track);
+
+	struct mat44 m;
+	mat44_multiply(&m, &render->projection, &render->view);
+	float planes[6][4];
+	for (int i = 0; i < 6; i++) {
+		int row = i >> 1;
+		float sign = (i & 1) ? -1.0f : 1.0f;
+		for (int k = 0; k < 4; k++) planes[i][k] = mat44_at(&m, k, 3) + sign * mat44_at(&m, k, row);
+	}
+
+	struct track_bounds* b = &track->bounds;
+	uint8_t* visible = render->node_visible;
+	int n = track->node_count;
+	int culled = 0;
+	int i = 0;
+	#ifdef __SSE__
+	__m128 zero = _mm_setzero_ps();
+	for (; i + 4 <= n; i += 4) {
+		__m128 cx = _mm_loadu_ps(&b->cx[i]);
+		__m128 cy = _mm_loadu_ps(&b->cy[i]);
+		__m128 cz = _mm_loadu_ps(&b->cz[i]);
+		__m128 ex = _mm_loadu_ps(&b->ex[i]);
+		__m128 ey = _mm_loadu_ps(&b->ey[i]);
+		__m128 ez = _mm_loadu_ps(&b->ez[i]);
+		__m128 out = zero;
+		for (int j = 0; j < 6; j++) {
+			float* p = planes[j];
+			__m128 d = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(_mm_set1_ps(p[0]), cx), _mm_mul_ps(_mm_set1_ps(p[1]), cy)),
+				_mm_add_ps(_mm_mul_ps(_mm_set1_ps(p[2]), cz), _mm_set1_ps(p[3])));
+			__m128 r = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(_mm_set1_ps(fabsf(p[0])), ex), _mm_mul_ps(_mm_set1_ps(fabsf(p[1])), ey)),
+				_mm_mul_ps(_mm_set1_ps(fabsf(p[2])), ez));
+			out = _mm_or_ps(out, _mm_cmplt_ps(_mm_add_ps(d, r), zero));
+		}
+		int mask = _mm_movemask_ps(out);
+		for (int k = 0; k < 4; k++) {
+			int v = !(mask & (1<<k));
+			visible[i+k] = v;
+			culled += !v;
+		}
+	}
+	#endif
+	for (; i < n; i++) {
+		int v = 1;
+		for (int j = 0; j < 6; j++) {
+			float* p = planes[j];
+			float d = p[0]*b->cx[i] + p[1]*b->cy[i] + p[2]*b->cz[i] + p[3];
+			float r = fabsf(p[0])*b->ex[i] + fabsf(p[1])*b->ey[i] + fabsf(p[2])*b->ez[i];
+			if (d + r < 0) v = 0;
+		}
+		visible[i] = v;
+		culled += !v;
+	}
+	render->node_culled = culled;
+}
+
 void render_clear(struct render* render)
 {
 	gl_viewport_from_sdl_window(render->window);
@@ -309,18 +855,10 @@ void render_clear(struct render* render)
 void render_horizon(struct render* render)
 {
 	struct render_horizon* h = &render->horizon;
-	shader_use(&h->shader);
+	render_camera(render);
+	shader_use(&h->shader, &render->camera);
 	glEnableVertexAttribArray(h->apos); CHKGL;
 
-	{
-		GLint location = glGetUniformLocation(h->shader.program, "u_projection");
-		glUniformMatrix4fv(location, 1, GL_FALSE, render->projection.s);
-	}
-	{
-		GLint location = glGetUniformLocation(h->shader.program, "u_view");
-		glUniformMatrix4fv(location, 1, GL_FALSE, render->view.s);
-	}
-
 	glBindBuffer(GL_ARRAY_BUFFER, h->vertex_buffer); CHKGL;
 	glVertexAttribPointer(h->apos, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), 0); CHKGL;
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, h->index_buffer); CHKGL;
@@ -348,6 +886,7 @@ void render_track(struct render* render, struct track* track)
 	//glRotatef(xxx, 0, 1, 0);
 	//glTranslatef(-render->entity_cam->position.s[0], -render->entity_cam->z, -render->entity_cam->position.s[1]);
 
+	render_cull_nodes(render, track);
 	render_road(render, track);
 }
 
@@ -365,13 +904,6 @@ static int _screen_bases(struct render* render, struct vec3* bx, struct vec3* by
 	return ps.s[2] < 0;
 }
 
-static void _circle_point(int i, int N, float radius, float* x, float* y)
-{
-	float phi = I2RAD((float)(i%N) / (float)N);
-	*x = cosf(phi) * radius;
-	*y = sinf(phi) * radius;
-}
-
 static void render_circle(struct render* render, struct vec3* pos, float radius, struct vec4* color)
 {
 	struct vec3 bx, by;
@@ -447,11 +979,9 @@ void render_track_position_handles(struct render* render, struct track* track)
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); CHKGL;
 
+	render_camera(render);
 	dtype_begin(&render->color_dtype);
 
-	dtype_set_matrix(&render->color_dtype, "u_projection", &render->projection);
-	dtype_set_matrix(&render->color_dtype, "u_view", &render->view);
-
 	struct vec4 primary_color = {{1, 1, 0, 1}};
 	struct vec4 secondary_color = {{0.5, 0.6, 1, 1}};
 	struct vec4 line_color = {{0.3, 0.8, 0.3, 1}};
@@ -461,7 +991,10 @@ void render_track_position_handles(struct render* render, struct track* track)
 
 	struct track_point tps[4];
 
+	render_cull_nodes(render, track);
+
 	for (int i = 0; i < track->node_count; i++) {
+		if (!render->node_visible[i]) continue;
 		struct track_node* node = track_get_node(track, i);
 		int j;
 		switch (node->type) {
@@ -513,10 +1046,8 @@ void render_begin_color(struct render* render, int depth_mode)
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); CHKGL;
 
+	render_camera(render);
 	dtype_begin(&render->color_dtype);
-
-	dtype_set_matrix(&render->color_dtype, "u_projection", &render->projection);
-	dtype_set_matrix(&render->color_dtype, "u_view", &render->view);
 }
 
 void render_end_color(struct render* render)
@@ -589,11 +1120,9 @@ void render_box(struct render* render, struct mat44* model, struct vec3* extents
 {
 	glDisable(GL_CULL_FACE);
 
+	render_camera(render);
 	dtype_begin(&render->road_dtype);
 
-	dtype_set_matrix(&render->road_dtype, "u_projection", &render->projection);
-	dtype_set_matrix(&render->road_dtype, "u_view", &render->view);
-
 	for (int i = 0; i < 3; i++) {
 		int ap = 1<<i;
 		for (int j = 0; j < 2; j++) {
@@ -634,11 +1163,9 @@ void render_a_wheel(struct render* render, struct mat44* model, float radius, fl
 {
 	glDisable(GL_CULL_FACE);
 
+	render_camera(render);
 	dtype_begin(&render->road_dtype);
 
-	dtype_set_matrix(&render->road_dtype, "u_projection", &render->projection);
-	dtype_set_matrix(&render->road_dtype, "u_view", &render->view);
-
 	int N = 32;
 
 	for (int i = 0; i < N; i++) {
@@ -672,6 +1199,102 @@ void render_a_wheel(struct render* render, struct mat44* model, float radius, fl
 	dtype_end(&render->road_dtype);
 }
 
+void render_vehicle(struct render* render, struct sim_vehicle_pose* pose)
+{
+	for (int w = 0; w < 4; w++) {
+		render_a_wheel(render, &pose->wheels[w], pose->wheel_radius, 0.08);
+	}
+	render_box(render, &pose->chassis, &pose->chassis_extents);
+}
+
+static void _draw_instances(struct render_instanced* ri, GLuint mesh_buffer, int n_vertices, struct sim_transforms* tx, int first, int count, struct vec3* scale)
+{
+	glUniform3fv(ri->u_scale, 1, scale->s);
+
+	glBindBuffer(GL_ARRAY_BUFFER, mesh_buffer); CHKGL;
+	size_t stride = RENDER_MESH_FLOATS * sizeof(float);
+	glVertexAttribPointer(ri->a_position, 3, GL_FLOAT, GL_FALSE, stride, (char*)0); CHKGL;
+	glVertexAttribPointer(ri->a_normal, 3, GL_FLOAT, GL_FALSE, stride, (char*)(3*sizeof(float))); CHKGL;
+	glVertexAttribPointer(ri->a_material, 1, GL_FLOAT, GL_FALSE, stride, (char*)(6*sizeof(float))); CHKGL;
+
+	// each matrix column is its own tightly packed vec4 array
+	glBindBuffer(GL_ARRAY_BUFFER, ri->instance_buffer); CHKGL;
+	for (int c = 0; c < 4; c++) {
+		size_t offset = ((size_t)c * tx->cap + first) * 4 * sizeof(float);
+		glVertexAttribPointer(ri->a_model[c], 4, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (char*)offset); CHKGL;
+	}
+
+	glDrawArraysInstanced(GL_TRIANGLES, 0, n_vertices, count); CHKGL;
+}
+
+/* all vehicles in two instanced draws (chassis, wheels) straight from the
+ * sim's transform buffer; falls back to render_vehicle() per vehicle */
+void render_vehicles(struct render* render, struct sim* sim)
+{
+	int n_vehicles = sim_vehicle_count(sim);
+	if (n_vehicles == 0) return;
+
+	// all vehicles are built the same
+	struct sim_vehicle_pose pose;
+	sim_vehicle_get_pose(sim_get_vehicle(sim, 0), &pose);
+
+	struct render_instanced* ri = &render->instanced;
+	if (!ri->enabled) {
+		for (int i = 0; i < n_vehicles; i++) {
+			if (i > 0) sim_vehicle_get_pose(sim_get_vehicle(sim, i), &pose);
+			render_vehicle(render, &pose);
+		}
+		return;
+	}
+
+	struct sim_transforms tx;
+	sim_get_transforms(sim, &tx);
+	ASSERT(tx.n_vehicles == n_vehicles);
+
+	glDisable(GL_CULL_FACE);
+
+	render_camera(render);
+	shader_use(&ri->shader, &render->camera);
+
+	// orphan and refill; the whole block goes up as is
+	glBindBuffer(GL_ARRAY_BUFFER, ri->instance_buffer); CHKGL;
+	glBufferData(GL_ARRAY_BUFFER, (size_t)tx.cap * 4 * 4 * sizeof(float), tx.columns, GL_STREAM_DRAW); CHKGL;
+
+	glEnableVertexAttribArray(ri->a_position);
+	glEnableVertexAttribArray(ri->a_normal);
+	glEnableVertexAttribArray(ri->a_material);
+	for (int c = 0; c < 4; c++) {
+		glEnableVertexAttribArray(ri->a_model[c]);
+		glVertexAttribDivisorARB(ri->a_model[c], 1);
+	}
+	CHKGL;
+
+	_draw_instances(ri, ri->box_buffer, ri->box_n_vertices, &tx, 0, n_vehicles, &pose.chassis_extents);
+
+	float wheel_width = 0.08;
+	struct vec3 wheel_scale = {{wheel_width / 2, pose.wheel_radius, pose.wheel_radius}};
+	_draw_instances(ri, ri->wheel_buffer, ri->wheel_n_vertices, &tx, n_vehicles, n_vehicles * 4, &wheel_scale);
+
+	for (int c = 0; c < 4; c++) {
+		glVertexAttribDivisorARB(ri->a_model[c], 0);
+		glDisableVertexAttribArray(ri->a_model[c]);
+	}
+	glDisableVertexAttribArray(ri->a_position);
+	glDisableVertexAttribArray(ri->a_normal);
+	glDisableVertexAttribArray(ri->a_material);
+	CHKGL;
+
+	glUseProgram(0); CHKGL;
+}
+
+// suspension rays; call between render_begin_color() and render_end_color()
+void render_vehicle_visualize(struct render* render, struct sim_vehicle_pose* pose)
+{
+	for (int w = 0; w < 4; w++) {
+		render_draw_vector(render, &pose->wheel_hardpoints[w], &pose->wheel_directions[w], NULL);
+	}
+}
+
 void render_flip(struct render* render)
 {
 	SDL_GL_SwapWindow(render->window);
@@ -6,6 +6,10 @@
 #include "m.h"
 #include "d.h"
 #include "track.h"
+#include "sim.h"
+
+// position, normal, material; like road_dtype
+#define RENDER_MESH_FLOATS (7)
 
 struct render {
 	SDL_Window* window;
@@ -14,10 +18,49 @@ struct render {
 	struct mat44 view;
 
 	struct dbuf dbuf;
+	struct shader_camera camera; // projection and view, as last drawn with
 	struct dtype road_dtype;
 	struct dtype color_dtype;
 	float color_alpha_multiplier;
 
+	/* road geometry, one fixed size slot per track node in a static
+	 * buffer, holding every level of detail; a slot is only rebuilt when
+	 * the points it was derived from change. see render_road() */
+	struct render_road_cache {
+		GLuint vertex_buffer;
+		int cap; // slots
+		struct track_point* built; // 4 per slot
+		int* state; // enum road_slot_state in render.c
+		GLint* first; // per slot, for glMultiDrawArrays()
+		GLsizei* count;
+		float* scratch; // one slot
+		int rebuilt; // slots rebuilt last frame
+	} road_cache;
+
+	/* the road tessellated in the vertex shader; only each node's four
+	 * derived track points go up, as per instance attributes. needs
+	 * instancing, else the road cache above is used */
+	struct render_road_gpu {
+		int enabled;
+		struct shader shader;
+		GLint u_subdiv;
+		GLuint a_point[4]; // position and width
+		GLuint a_normal[4];
+		GLuint instance_buffer;
+		float* data; // ROAD_NODE_FLOATS per node with a next node
+		int* node; // track node of each instance in data
+		float* uploaded; // what instance_buffer holds
+		int cap;
+		int n_uploaded;
+	} road_gpu;
+
+	// per track node, whether its bounds touch the view frustum
+	uint8_t* node_visible;
+	int node_culled; // nodes culled last frame
+	// per visible track node, its road level of detail; see render_road_lod()
+	uint8_t* node_lod;
+	int road_slices; // drawn last frame
+
 	struct render_horizon {
 		GLuint vertex_buffer;
 		float* vertex_data;
@@ -27,6 +70,20 @@ struct render {
 		GLuint apos;
 	} horizon;
 
+	// vehicles drawn from struct sim_transforms; see render_vehicles()
+	struct render_instanced {
+		int enabled;
+		struct shader shader;
+		GLint u_scale;
+		GLuint a_position, a_normal, a_material;
+		GLuint a_model[4];
+		GLuint box_buffer;
+		int box_n_vertices;
+		GLuint wheel_buffer;
+		int wheel_n_vertices;
+		GLuint instance_buffer;
+	} instanced;
+
 	int frame;
 };
 
@@ -45,6 +102,10 @@ void render_end_color(struct render* render);
 void render_draw_vector(struct render* render, struct vec3* origin, struct vec3* v, struct vec4* colorp);
 void render_box(struct render* render, struct mat44* model, struct vec3* extents);
 
+void render_vehicle(struct render* render, struct sim_vehicle_pose* pose);
+void render_vehicles(struct render* render, struct sim* sim);
+void render_vehicle_visualize(struct render* render, struct sim_vehicle_pose* pose);
+
 void render_flip(struct render* render);
 
 #endif/*RENDER_H*/
@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "replay.h"
+#include "a.h"
+
+#define FNV_OFFSET (0xcbf29ce484222325ULL)
+#define FNV_PRIME (0x100000001b3ULL)
+
+static uint64_t fnv1a(uint64_t h, const void* data, size_t sz)
+{
+	const uint8_t* p = data;
+	for (size_t i = 0; i < sz; i++) {
+		h ^= p[i];
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+static uint64_t fnv1a_track_point(uint64_t h, struct track_point* tp)
+{
+	h = fnv1a(h, &tp->position, sizeof(struct vec3));
+	h = fnv1a(h, &tp->normal, sizeof(struct vec3));
+	h = fnv1a(h, &tp->width, sizeof(float));
+	return h;
+}
+
+uint64_t replay_hash_track(struct track* track)
+{
+	// field by field; the node union has padding and selection flags
+	uint64_t h = FNV_OFFSET;
+	h = fnv1a(h, &track->node_count, sizeof(int));
+	for (int i = 0; i < track->node_count; i++) {
+		struct track_node* node = track_get_node(track, i);
+		int type = node->type;
+		h = fnv1a(h, &type, sizeof(int));
+		if (node->type != TRACK_BEZIER) continue;
+		struct track_node_bezier* bz = &node->bezier;
+		h = fnv1a(h, &bz->prev, sizeof(int32_t));
+		h = fnv1a(h, &bz->next, sizeof(int32_t));
+		for (int j = 0; j < 2; j++) h = fnv1a_track_point(h, &bz->p[j]);
+	}
+	return h;
+}
+
+static uint8_t ctrl_encode(const struct sim_ctrl* c)
+{
+	return (c->accel ? 1 : 0) | (c->brake ? 2 : 0) | (((c->steer + 1) & 3) << 2);
+}
+
+static void ctrl_decode(struct sim_ctrl* c, uint8_t b)
+{
+	c->accel = b & 1;
+	c->brake = (b >> 1) & 1;
+	c->steer = ((b >> 2) & 3) - 1;
+}
+
+static void write_varint(FILE* f, uint64_t v)
+{
+	while (v >= 0x80) {
+		fputc((int)(v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+	fputc((int)v, f);
+}
+
+static uint64_t read_varint(const uint8_t** p, const uint8_t* end)
+{
+	uint64_t v = 0;
+	int shift = 0;
+	for (;;) {
+		if (*p >= end || shift > 63) arghf("replay: truncated varint\n");
+		uint8_t b = *((*p)++);
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) return v;
+		shift += 7;
+	}
+}
+
+static uint32_t step_hz(struct sim* sim)
+{
+	return (uint32_t)lrintf(1.0f / sim_get_step_dt(sim));
+}
+
+void replay_recorder_open(struct replay_recorder* rec, const char* path, struct track* track, struct sim* sim, int n_vehicles)
+{
+	memset(rec, 0, sizeof(struct replay_recorder));
+	ASSERT(n_vehicles >= 1 && n_vehicles <= sim_vehicle_count(sim));
+
+	rec->file = fopen(path, "wb");
+	if (rec->file == NULL) arghf("%s: cannot open for writing\n", path);
+	rec->n_vehicles = n_vehicles;
+	rec->ctrl = calloc(n_vehicles, 1);
+	AN(rec->ctrl);
+
+	struct replay_header header;
+	memset(&header, 0, sizeof(struct replay_header));
+	memcpy(header.magic, REPLAY_MAGIC, 4);
+	header.version = REPLAY_VERSION;
+	header.track_hash = replay_hash_track(track);
+	header.initial_hash = sim_state_hash(sim);
+	header.step_hz = step_hz(sim);
+	header.n_vehicles = n_vehicles;
+	header.quality = sim_get_quality(sim);
+	ASSERT(fwrite(&header, sizeof(struct replay_header), 1, rec->file) == 1);
+}
+
+static void replay_recorder_flush(struct replay_recorder* rec)
+{
+	if (rec->run == 0) return;
+	write_varint(rec->file, rec->run);
+	ASSERT(fwrite(rec->ctrl, rec->n_vehicles, 1, rec->file) == 1);
+	rec->run = 0;
+}
+
+void replay_record(struct replay_recorder* rec, const struct sim_ctrl* ctrls, int n_steps)
+{
+	if (n_steps <= 0) return;
+	int changed = 0;
+	for (int i = 0; i < rec->n_vehicles; i++) {
+		if (ctrl_encode(&ctrls[i]) != rec->ctrl[i]) changed = 1;
+	}
+	if (changed) {
+		replay_recorder_flush(rec);
+		for (int i = 0; i < rec->n_vehicles; i++) rec->ctrl[i] = ctrl_encode(&ctrls[i]);
+	}
+	rec->run += n_steps;
+	rec->n_steps += n_steps;
+}
+
+void replay_recorder_close(struct replay_recorder* rec, struct sim* sim)
+{
+	replay_recorder_flush(rec);
+
+	struct replay_trailer trailer;
+	memset(&trailer, 0, sizeof(struct replay_trailer));
+	trailer.n_steps = rec->n_steps;
+	trailer.final_hash = sim_state_hash(sim);
+	memcpy(trailer.magic, REPLAY_TRAILER_MAGIC, 4);
+	ASSERT(fwrite(&trailer, sizeof(struct replay_trailer), 1, rec->file) == 1);
+
+	AZ(fclose(rec->file));
+	free(rec->ctrl);
+	memset(rec, 0, sizeof(struct replay_recorder));
+}
+
+void replay_player_open(struct replay_player* player, const char* path)
+{
+	memset(player, 0, sizeof(struct replay_player));
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) arghf("%s: cannot open\n", path);
+	struct stat st;
+	AZ(fstat(fd, &st));
+	player->size = st.st_size;
+	if (player->size < sizeof(struct replay_header) + sizeof(struct replay_trailer)) {
+		arghf("%s: not a replay\n", path);
+	}
+	void* data = mmap(NULL, player->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) arghf("%s: mmap failed\n", path);
+	AZ(close(fd));
+	// played front to back, once
+	madvise(data, player->size, MADV_SEQUENTIAL);
+	player->data = data;
+
+	memcpy(&player->header, player->data, sizeof(struct replay_header));
+	memcpy(&player->trailer, player->data + player->size - sizeof(struct replay_trailer), sizeof(struct replay_trailer));
+	if (memcmp(player->header.magic, REPLAY_MAGIC, 4) != 0 || memcmp(player->trailer.magic, REPLAY_TRAILER_MAGIC, 4) != 0) {
+		arghf("%s: not a replay, or not closed properly\n", path);
+	}
+	if (player->header.version != REPLAY_VERSION) {
+		arghf("%s: replay version %u, expected %d\n", path, player->header.version, REPLAY_VERSION);
+	}
+	ASSERT(player->header.n_vehicles >= 1);
+	if (player->header.quality >= SIM_QUALITY_COUNT) arghf("%s: bad quality %u\n", path, player->header.quality);
+
+	player->cursor = player->data + sizeof(struct replay_header);
+	player->end = player->data + player->size - sizeof(struct replay_trailer);
+	player->ctrls = calloc(player->header.n_vehicles, sizeof(struct sim_ctrl));
+	AN(player->ctrls);
+}
+
+void replay_player_begin(struct replay_player* player, struct track* track, struct sim* sim)
+{
+	if (replay_hash_track(track) != player->header.track_hash) arghf("replay: recorded on another track\n");
+	if (sim_vehicle_count(sim) < (int)player->header.n_vehicles) arghf("replay: needs %u vehicles\n", player->header.n_vehicles);
+	// the tier sets its own rate; -hz may have overridden it when recording
+	sim_set_quality(sim, player->header.quality);
+	sim_set_step_rate(sim, player->header.step_hz);
+	if (sim_state_hash(sim) != player->header.initial_hash) arghf("replay: initial state differs\n");
+}
+
+// loads the next run's controls into the sim; 0 at the end
+static int next_run(struct replay_player* player, struct sim* sim)
+{
+	if (player->run_left > 0) return 1;
+	if (player->cursor >= player->end) return 0;
+	player->run_left = read_varint(&player->cursor, player->end);
+	if (player->run_left == 0) arghf("replay: empty run\n");
+	int n = player->header.n_vehicles;
+	if (player->end - player->cursor < n) arghf("replay: truncated run\n");
+	for (int i = 0; i < n; i++) ctrl_decode(&player->ctrls[i], *(player->cursor++));
+	sim_apply_controls(sim, player->ctrls, n);
+	return 1;
+}
+
+int replay_play(struct replay_player* player, struct sim* sim, int max_steps)
+{
+	int n = 0;
+	while (n < max_steps && next_run(player, sim)) {
+		int steps = max_steps - n;
+		if ((uint64_t)steps > player->run_left) steps = player->run_left;
+		sim_step_fixed(sim, steps);
+		player->run_left -= steps;
+		player->n_steps += steps;
+		n += steps;
+	}
+	return n;
+}
+
+int replay_play_realtime(struct replay_player* player, struct sim* sim, double dt)
+{
+	int n = 0;
+	while (next_run(player, sim)) {
+		int limit = player->run_left > (1<<30) ? (1<<30) : (int)player->run_left;
+		int steps = sim_step_limited(sim, dt, limit);
+		dt = 0;
+		player->run_left -= steps;
+		player->n_steps += steps;
+		n += steps;
+		if (player->run_left > 0) break; // not due yet
+	}
+	return n;
+}
+
+int replay_player_done(struct replay_player* player)
+{
+	return player->run_left == 0 && player->cursor >= player->end;
+}
+
+int replay_player_verify(struct replay_player* player, struct sim* sim)
+{
+	ASSERT(replay_player_done(player));
+	return player->n_steps == player->trailer.n_steps && sim_state_hash(sim) == player->trailer.final_hash;
+}
+
+void replay_player_close(struct replay_player* player)
+{
+	AZ(munmap((void*)player->data, player->size));
+	free(player->ctrls);
+	memset(player, 0, sizeof(struct replay_player));
+}
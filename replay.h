@@ -0,0 +1,80 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "track.h"
+#include "sim.h"
+
+/* replay file:
+ *   struct replay_header
+ *   runs: <varint steps> <one ctrl byte per vehicle>, as long as the
+ *         controls stay the same
+ *   struct replay_trailer
+ * in host byte order (XXX). the trailer is at a fixed offset from the end, so
+ * files are read through mmap() without ever loading them */
+
+#define REPLAY_MAGIC "QDRP"
+#define REPLAY_TRAILER_MAGIC "QDRE"
+#define REPLAY_VERSION (2)
+
+struct replay_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t track_hash; // see replay_hash_track()
+	uint64_t initial_hash; // see sim_state_hash()
+	uint32_t step_hz;
+	uint32_t n_vehicles; // vehicles [0;n) are recorded
+	uint32_t quality; // SIM_QUALITY_*; sets solver iterations and all
+	uint32_t pad;
+};
+
+struct replay_trailer {
+	uint64_t n_steps;
+	uint64_t final_hash;
+	char magic[4];
+	uint32_t pad;
+};
+
+uint64_t replay_hash_track(struct track* track);
+
+struct replay_recorder {
+	FILE* file;
+	int n_vehicles;
+	uint8_t* ctrl; // current run
+	uint64_t run;
+	uint64_t n_steps;
+};
+
+void replay_recorder_open(struct replay_recorder* rec, const char* path, struct track* track, struct sim* sim, int n_vehicles);
+// n_steps were taken with these controls (n_vehicles of them)
+void replay_record(struct replay_recorder* rec, const struct sim_ctrl* ctrls, int n_steps);
+void replay_recorder_close(struct replay_recorder* rec, struct sim* sim);
+
+struct replay_player {
+	const uint8_t* data;
+	size_t size;
+	const uint8_t* cursor;
+	const uint8_t* end;
+	struct replay_header header;
+	struct replay_trailer trailer;
+	struct sim_ctrl* ctrls; // current run
+	uint64_t run_left;
+	uint64_t n_steps;
+};
+
+// maps the file; the sim must have at least header.n_vehicles vehicles
+void replay_player_open(struct replay_player* player, const char* path);
+// checks the track and the sim against the header and sets the quality and step rate
+void replay_player_begin(struct replay_player* player, struct track* track, struct sim* sim);
+// runs up to max_steps as fast as possible; returns steps taken, 0 at the end
+int replay_play(struct replay_player* player, struct sim* sim, int max_steps);
+// real time playback; dt like sim_step(). returns steps taken
+int replay_play_realtime(struct replay_player* player, struct sim* sim, double dt);
+int replay_player_done(struct replay_player* player);
+// at the end; 1 if the sim ended up exactly where the recording did
+int replay_player_verify(struct replay_player* player, struct sim* sim);
+void replay_player_close(struct replay_player* player);
+
+#endif/*REPLAY_H*/
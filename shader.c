@@ -1,11 +1,38 @@
 #include <stdlib.h>
+#include <string.h>
 #include "shader.h"
 #include "a.h"
 
+static const char* camera_block_src =
+	"#extension GL_ARB_uniform_buffer_object : require\n"
+	"layout(std140) uniform camera {\n"
+	"	mat4 u_projection;\n"
+	"	mat4 u_view;\n"
+	"};\n";
+
+static const char* camera_uniforms_src =
+	"uniform mat4 u_projection;\n"
+	"uniform mat4 u_view;\n";
+
+static int shader_has_camera_block()
+{
+	return GLEW_ARB_uniform_buffer_object;
+}
+
 static GLuint create_shader(GLenum type, const char* src)
 {
 	GLuint shader = glCreateShader(type); CHKGL;
-	glShaderSource(shader, 1, &src, 0);
+	if (type == GL_VERTEX_SHADER) {
+		// the camera goes right after #version
+		const char* body = strchr(src, '\n');
+		AN(body);
+		body++;
+		const char* srcs[3] = {src, shader_has_camera_block() ? camera_block_src : camera_uniforms_src, body};
+		GLint lengths[3] = {body - src, -1, -1};
+		glShaderSource(shader, 3, srcs, lengths);
+	} else {
+		glShaderSource(shader, 1, &src, 0);
+	}
 	glCompileShader(shader);
 
 	GLint status;
@@ -21,7 +48,7 @@ static GLuint create_shader(GLenum type, const char* src)
 	return shader;
 }
 
-void shader_init(struct shader* s, const char* vertex, const char* fragment)
+void shader_init(struct shader* s, const char* vertex, const char* fragment, const char** attribs)
 {
 	GLuint vertex_shader = create_shader(GL_VERTEX_SHADER, vertex);
 	GLuint fragment_shader = create_shader(GL_FRAGMENT_SHADER, fragment);
@@ -31,7 +58,10 @@ void shader_init(struct shader* s, const char* vertex, const char* fragment)
 	glAttachShader(s->program, vertex_shader);
 	glAttachShader(s->program, fragment_shader);
 
-	// glBindAttribLocation?!
+	if (attribs != NULL) {
+		for (GLuint i = 0; attribs[i] != NULL; i++) glBindAttribLocation(s->program, i, attribs[i]);
+		CHKGL;
+	}
 
 	glLinkProgram(s->program);
 
@@ -47,10 +77,48 @@ void shader_init(struct shader* s, const char* vertex, const char* fragment)
 
 	glDeleteShader(vertex_shader);
 	glDeleteShader(fragment_shader);
+
+	s->camera_serial = 0;
+	if (shader_has_camera_block()) {
+		GLuint index = glGetUniformBlockIndex(s->program, "camera");
+		if (index != GL_INVALID_INDEX) glUniformBlockBinding(s->program, index, SHADER_CAMERA_BINDING);
+		s->u_projection = s->u_view = -1;
+	} else {
+		s->u_projection = glGetUniformLocation(s->program, "u_projection");
+		s->u_view = glGetUniformLocation(s->program, "u_view");
+	}
+	CHKGL;
 }
 
-void shader_use(struct shader* s)
+void shader_use(struct shader* s, struct shader_camera* camera)
 {
 	glUseProgram(s->program);
+	if (camera == NULL || camera->block || s->camera_serial == camera->serial) return;
+	glUniformMatrix4fv(s->u_projection, 1, GL_FALSE, &camera->s[0]);
+	glUniformMatrix4fv(s->u_view, 1, GL_FALSE, &camera->s[16]);
+	s->camera_serial = camera->serial;
+}
+
+void shader_camera_init(struct shader_camera* camera)
+{
+	memset(camera, 0, sizeof *camera);
+	camera->serial = 1;
+	camera->block = shader_has_camera_block();
+	if (!camera->block) return;
+	glGenBuffers(1, &camera->buffer); CHKGL;
+	glBindBuffer(GL_UNIFORM_BUFFER, camera->buffer); CHKGL;
+	glBufferData(GL_UNIFORM_BUFFER, sizeof camera->s, camera->s, GL_DYNAMIC_DRAW); CHKGL;
+	glBindBufferBase(GL_UNIFORM_BUFFER, SHADER_CAMERA_BINDING, camera->buffer); CHKGL;
+}
+
+void shader_camera_set(struct shader_camera* camera, struct mat44* projection, struct mat44* view)
+{
+	if (memcmp(&camera->s[0], projection->s, sizeof projection->s) == 0 && memcmp(&camera->s[16], view->s, sizeof view->s) == 0) return;
+	memcpy(&camera->s[0], projection->s, sizeof projection->s);
+	memcpy(&camera->s[16], view->s, sizeof view->s);
+	camera->serial++;
+	if (!camera->block) return;
+	glBindBuffer(GL_UNIFORM_BUFFER, camera->buffer); CHKGL;
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof camera->s, camera->s); CHKGL;
 }
 
@@ -3,11 +3,33 @@
 
 #include <GL/glew.h>
 
+#include "m.h"
+
+#define SHADER_CAMERA_BINDING (0)
+
 struct shader {
 	GLuint program;
+	GLint u_projection, u_view; // without a camera block
+	unsigned camera_serial; // what u_projection/u_view were last set to
 };
 
-void shader_init(struct shader*, const char* vertex, const char* fragment);
-void shader_use(struct shader*);
+/* u_projection and u_view, shared by every program. with
+ * ARB_uniform_buffer_object it's one uniform buffer on SHADER_CAMERA_BINDING,
+ * updated when it changes; else shader_use() sets a program's uniforms when
+ * they're behind. vertex shaders get these declared after their #version
+ * line, so they mustn't declare them themselves */
+struct shader_camera {
+	int block;
+	GLuint buffer;
+	float s[32];
+	unsigned serial;
+};
+
+void shader_camera_init(struct shader_camera*);
+void shader_camera_set(struct shader_camera*, struct mat44* projection, struct mat44* view);
+
+// attribs is NULL, or NULL terminated names bound to locations 0, 1, 2, ...
+void shader_init(struct shader*, const char* vertex, const char* fragment, const char** attribs);
+void shader_use(struct shader*, struct shader_camera*);
 
 #endif/*SHADER_H*/
@@ -1,140 +1,3210 @@
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Woverloaded-virtual"
 #include "btBulletDynamicsCommon.h"
+#ifdef SIM_MT
+// needs a Bullet built with BT_THREADSAFE=1, see Makefile
+#include "BulletDynamics/Dynamics/btDiscreteDynamicsWorldMt.h"
+#include "BulletDynamics/ConstraintSolver/btSequentialImpulseConstraintSolverMt.h"
+#include "BulletCollision/CollisionDispatch/btCollisionDispatcherMt.h"
+#include "LinearMath/btThreads.h"
+#endif
 #pragma clang diagnostic pop
 
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <math.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+
 #include "sim.h"
 
-#define WORLD_MAX (1000)
-#define WHEEL_RADIUS (0.3)
+#define WORLD_MAX (1000)
+#define WHEEL_RADIUS (0.3)
+#define SIM_HZ (60)
+#define SIM_CTRL_QUEUE_SZ (1<<14)
+#define SIM_CHASSIS_CONTACT_THRESHOLD (1e6)
+#define SIM_MAX_STEPS_PER_CALL (128)
+#define SIM_STEP_BUDGET (0.008)
+// over budget, this many steps of debt are kept to catch up on later
+#define SIM_MAX_BACKLOG_STEPS (4)
+#define SIM_SNAPSHOT_MAGIC (0x70616e73)
+// rays per worker job in sim_raycast_batch()
+#define SIM_RAYCAST_CHUNK (64)
+// track streaming: XZ tile size, and per step limits on chunks activated
+// (beyond the ones around a vehicle), retired, and checked for retirement
+#define SIM_TRACK_CHUNK_SIZE (32)
+#define SIM_STREAM_ACTIVATE_PER_STEP (2)
+#define SIM_STREAM_RETIRE_PER_STEP (2)
+#define SIM_STREAM_CHECKS_PER_STEP (16)
+// chunks are retired only this much further out than they're activated
+#define SIM_STREAM_HYSTERESIS (1.5)
+/* floating origin: vehicle 0 this far out in X or Z moves everything back,
+ * by a multiple of SIM_REBASE_SNAP so the shifts are exact in floats */
+#define SIM_REBASE_DISTANCE (256)
+#define SIM_REBASE_SNAP (128)
+// btRaycastVehicle's defaults, for the lite vehicles (see struct sim_fleet)
+#define SIM_FLEET_MAX_TRAVEL (5)
+#define SIM_FLEET_MAX_SUSPENSION_FORCE (6000)
+/* physics LOD: vehicles further than SIM_LOD_FAR from the focus leave the
+ * world and follow the track path, and come back inside SIM_LOD_NEAR.
+ * distances behind the focus count SIM_LOD_BEHIND times */
+#define SIM_LOD_FAR (250)
+#define SIM_LOD_NEAR (150)
+#define SIM_LOD_BEHIND (2)
+// share of a far vehicle's heading offset to the road removed per second
+#define SIM_LOD_SETTLE (0.5)
+// how far up and down far vehicles look for the ground
+#define SIM_LOD_PROBE (4)
+// cell size of the grid sim_lod_path::project() searches
+#define SIM_LOD_PATH_CELL (32)
+// at most this many cells a side; bigger cells on huge tracks
+#define SIM_LOD_PATH_CELLS_MAX (1024)
+
+// see struct sim_arena
+#define SIM_ARENA_BLOCK (1<<16)
+
+static void vec3_from_btVector3(struct vec3* v, btVector3 btv)
+{
+	for (int i = 0; i < 3; i++) v->s[i] = btv[i];
+}
+
+// what the renderer needs to know about a vehicle after a step
+struct sim_vehicle_state {
+	btTransform chassis;
+	btTransform wheels[4];
+	btVector3 wheel_hardpoints[4];
+	btVector3 wheel_directions[4];
+};
+
+/* see struct sim_transforms; column-major like mat44, written straight from
+ * the basis so there's no identity+getOpenGLMatrix() round trip */
+struct sim_transform_buffer {
+	btAlignedObjectArray<float> columns; // btAlignedAllocator; 16-byte aligned
+	int n;
+	int cap;
+
+	void reset()
+	{
+		columns.clear();
+		n = 0;
+		cap = 0;
+	}
+
+	void resize(int new_n)
+	{
+		if (new_n > cap) {
+			int new_cap = cap ? cap : 16;
+			while (new_cap < new_n) new_cap *= 2;
+			btAlignedObjectArray<float> old;
+			old.copyFromArray(columns);
+			columns.resize(4 * 4 * new_cap);
+			for (int c = 0; c < 4; c++) {
+				if (n > 0) memcpy(&columns[c*new_cap*4], &old[c*cap*4], n * 4 * sizeof(float));
+			}
+			cap = new_cap;
+		}
+		n = new_n;
+	}
+
+	float* column(int c, int i)
+	{
+		return &columns[(c*cap + i)*4];
+	}
+
+	void set(int i, const btTransform& tx)
+	{
+		const btMatrix3x3& basis = tx.getBasis();
+		for (int c = 0; c < 3; c++) {
+			float* col = column(c, i);
+			col[0] = basis[0][c];
+			col[1] = basis[1][c];
+			col[2] = basis[2][c];
+			col[3] = 0;
+		}
+		const btVector3& origin = tx.getOrigin();
+		float* col = column(3, i);
+		col[0] = origin[0];
+		col[1] = origin[1];
+		col[2] = origin[2];
+		col[3] = 1;
+	}
+
+	void set_lerp(int i, const btTransform& a, const btTransform& b, float t)
+	{
+		btTransform tx;
+		tx.setOrigin(a.getOrigin().lerp(b.getOrigin(), t));
+		tx.setRotation(a.getRotation().slerp(b.getRotation(), t));
+		set(i, tx);
+	}
+
+	void get(int i, struct mat44* m)
+	{
+		for (int c = 0; c < 4; c++) memcpy(&m->s[c*4], column(c, i), 4 * sizeof(float));
+	}
+};
+
+// see struct sim_vehicle_pose; transforms go to the transform buffer, and
+// extents and radius are filled in by the vehicle
+static void vehicle_pose_lerp(struct sim_vehicle_pose* pose, struct sim_transform_buffer* transforms, int index, int n_vehicles, struct sim_vehicle_state* a, struct sim_vehicle_state* b, float t)
+{
+	transforms->set_lerp(index, a->chassis, b->chassis, t);
+	for (int w = 0; w < 4; w++) {
+		transforms->set_lerp(n_vehicles + index*4 + w, a->wheels[w], b->wheels[w], t);
+		vec3_from_btVector3(&pose->wheel_hardpoints[w], a->wheel_hardpoints[w].lerp(b->wheel_hardpoints[w], t));
+		vec3_from_btVector3(&pose->wheel_directions[w], a->wheel_directions[w].lerp(b->wheel_directions[w], t));
+	}
+}
+
+// the two most recent steps of every vehicle; this is what goes through
+// the triple buffer
+struct sim_poses {
+	btAlignedObjectArray<struct sim_vehicle_state> prev;
+	btAlignedObjectArray<struct sim_vehicle_state> cur;
+	double time; // sim_clock() when cur was stepped
+	btVector3 origin; // what prev and cur are relative to
+};
+
+/* sim_snapshot() layout: header, then the active chunk ids, the solver
+ * pool's seeds, n_bodies sim_snapshot_body, n_vehicles
+ * sim_snapshot_vehicle and n_manifolds sim_snapshot_manifold. only valid
+ * for the sim it was taken from, with the same vehicles */
+struct sim_snapshot_header {
+	uint32_t magic;
+	uint32_t size;
+	int n_bodies;
+	int n_vehicles;
+	int n_manifolds;
+	int n_active_chunks; // streamed track chunks; their ids follow the header
+	int n_pool_seeds; // one per pooled MT solver, after the chunk ids
+	int retire_cursor;
+	btScalar origin[3];
+	unsigned long rand_seed;
+	double accumulator;
+};
+
+/* every non-static body, which are just the chassis, in vehicle order; the
+ * world's own object order changes as track chunks come and go */
+struct sim_snapshot_body {
+	btTransform world_transform;
+	btTransform interpolation_world_transform;
+	btTransform motion_state_transform;
+	btVector3 linear_velocity;
+	btVector3 angular_velocity;
+	btVector3 interpolation_linear_velocity;
+	btVector3 interpolation_angular_velocity;
+	btVector3 total_force;
+	btVector3 total_torque;
+	int activation_state;
+	btScalar deactivation_time;
+	btScalar hit_fraction;
+};
+
+struct sim_snapshot_vehicle {
+	// suspension and contact state, but also engine/brake/steering
+	btWheelInfo wheels[4];
+	struct sim_vehicle_state prev;
+	struct sim_vehicle_state cur;
+};
+
+/* contact points carry the warm starting impulses, so they're needed for
+ * a bit-identical continuation. every manifold in the dispatcher's order,
+ * which rebuild_broadphase() makes the same on both ends; the objects are
+ * world array indices, there only as a check */
+struct sim_snapshot_manifold {
+	int object0;
+	int object1;
+	int n_contacts;
+	btManifoldPoint points[MANIFOLD_CACHE_SIZE];
+};
+
+// a manifold's contacts while the broadphase is rebuilt; see snapshot()
+struct sim_manifold_copy {
+	const btCollisionObject* body0;
+	const btCollisionObject* body1;
+	int n_contacts;
+	btManifoldPoint points[MANIFOLD_CACHE_SIZE];
+};
+
+// the same contact, seen from the other body
+static void sim_swap_contact(btManifoldPoint* pt)
+{
+	btSwap(pt->m_localPointA, pt->m_localPointB);
+	btSwap(pt->m_positionWorldOnA, pt->m_positionWorldOnB);
+	pt->m_normalWorldOnB = -pt->m_normalWorldOnB;
+	btSwap(pt->m_partId0, pt->m_partId1);
+	btSwap(pt->m_index0, pt->m_index1);
+}
+
+// memcpy in/out so the caller's buffer needs no particular alignment
+struct sim_snapshot_cursor {
+	char* p;
+	char* end;
+
+	bool fits(size_t sz)
+	{
+		return (size_t)(end - p) >= sz;
+	}
+
+	void put(const void* src, size_t sz)
+	{
+		ASSERT(fits(sz));
+		memcpy(p, src, sz);
+		p += sz;
+	}
+
+	void get(void* dst, size_t sz)
+	{
+		ASSERT(fits(sz));
+		memcpy(dst, p, sz);
+		p += sz;
+	}
+
+	void skip(size_t sz)
+	{
+		ASSERT(fits(sz));
+		p += sz;
+	}
+};
+
+/* see enum sim_quality. medium is what the sim always did. the contact
+ * processing threshold goes on the chassis; a pair uses the smaller of its
+ * two bodies' thresholds, so it limits every contact a vehicle has */
+struct sim_quality_tier {
+	const char* name;
+	int hz;
+	int solver_iterations;
+	int split_impulse;
+	btScalar contact_processing_threshold;
+};
+
+static const struct sim_quality_tier sim_quality_tiers[SIM_QUALITY_COUNT] = {
+	{"low", 30, 4, 0, 0.05},
+	{"medium", 60, 10, 1, SIM_CHASSIS_CONTACT_THRESHOLD},
+	{"high", 120, 10, 1, SIM_CHASSIS_CONTACT_THRESHOLD},
+	{"ultra", 240, 20, 1, SIM_CHASSIS_CONTACT_THRESHOLD},
+};
+
+// auto quality: physics share of real time to go down above / up below
+#define SIM_QUALITY_LOAD_HIGH (0.4)
+#define SIM_QUALITY_LOAD_LOW (0.15)
+#define SIM_QUALITY_INTERVAL (1.0)
+
+static double sim_clock()
+{
+	typedef std::chrono::steady_clock clock;
+	return std::chrono::duration<double>(clock::now().time_since_epoch()).count();
+}
+
+struct sim_arena_block {
+	struct sim_arena_block* next;
+	size_t size;
+	size_t used;
+	size_t pad; // keeps the data after the header 16-byte aligned
+};
+
+/* bump allocator for the Bullet objects a sim builds up front: the world,
+ * the ground, blocks, the track body and vehicles. thousands of static
+ * blocks end up packed in a few big blocks instead of all over the heap.
+ * frees into it are no-ops; release() drops everything at once, which is
+ * only safe once everything allocated in it is gone (see sim::teardown()).
+ * stepping allocates from the heap as before, so the arena doesn't grow
+ * with contacts and streamed chunks coming and going */
+struct sim_arena {
+	struct sim_arena_block* head;
+
+	void initialize()
+	{
+		head = NULL;
+	}
+
+	void* alloc(size_t size)
+	{
+		size = (size + 15) & ~(size_t)15;
+		if (head == NULL || head->used + size > head->size) {
+			size_t block_size = size > SIM_ARENA_BLOCK ? size : SIM_ARENA_BLOCK;
+			struct sim_arena_block* block = (struct sim_arena_block*)malloc(sizeof(struct sim_arena_block) + block_size);
+			AN(block);
+			block->next = head;
+			block->size = block_size;
+			block->used = 0;
+			head = block;
+		}
+		char* p = (char*)(head + 1) + head->used;
+		head->used += size;
+		return p;
+	}
+
+	void release()
+	{
+		while (head != NULL) {
+			struct sim_arena_block* next = head->next;
+			free(head);
+			head = next;
+		}
+	}
+};
+
+// the arena Bullet allocations go to on this thread; NULL is the heap
+static thread_local struct sim_arena* sim_arena_current = NULL;
+
+struct sim_arena_scope {
+	struct sim_arena* prev;
+
+	sim_arena_scope(struct sim_arena* arena)
+	{
+		prev = sim_arena_current;
+		sim_arena_current = arena;
+	}
+
+	~sim_arena_scope()
+	{
+		sim_arena_current = prev;
+	}
+};
+
+/* Bullet's aligned allocation hook. the pointer before every block says
+ * where it came from: what to free() for the heap, NULL for an arena */
+static void* sim_aligned_alloc(size_t size, int alignment)
+{
+	struct sim_arena* arena = sim_arena_current;
+	size_t total = size + (size_t)alignment + sizeof(void*);
+	char* raw = (char*)(arena != NULL ? arena->alloc(total) : malloc(total));
+	AN(raw);
+	char* p = raw + sizeof(void*);
+	p += ((size_t)alignment - (size_t)p % (size_t)alignment) % (size_t)alignment;
+	void* base = arena != NULL ? NULL : raw;
+	memcpy(p - sizeof(void*), &base, sizeof(void*));
+	return p;
+}
+
+static void sim_aligned_free(void* p)
+{
+	if (p == NULL) return;
+	void* base;
+	memcpy(&base, (char*)p - sizeof(void*), sizeof(void*));
+	free(base);
+}
+
+/* the hook is global and has to be in before Bullet allocates anything,
+ * since its blocks can't be freed by Bullet's default allocator or vice
+ * versa; so every entry point that can create Bullet objects calls this */
+static void sim_install_allocator()
+{
+	static std::once_flag once;
+	std::call_once(once, []{ btAlignedAllocSetCustomAligned(sim_aligned_alloc, sim_aligned_free); });
+}
+
+#ifdef SIM_MT
+// Bullet's own thread pool; created on first use
+static btITaskScheduler* sim_default_task_scheduler()
+{
+	static std::mutex mutex;
+	static btITaskScheduler* scheduler = NULL;
+	std::lock_guard<std::mutex> lock(mutex);
+	struct sim_arena_scope heap(NULL); // outlives any sim
+	if (scheduler == NULL) scheduler = btCreateDefaultTaskScheduler();
+	// NULL if Bullet was built without BT_THREADSAFE
+	return scheduler != NULL ? scheduler : btGetSequentialTaskScheduler();
+}
+
+// set by sim_set_task_scheduler(); "sequential" is a choice too
+static std::atomic<int> sim_scheduler_chosen(0);
+
+// whatever sim_set_task_scheduler() installed, or the default one
+static btITaskScheduler* sim_task_scheduler()
+{
+	btITaskScheduler* current = btGetTaskScheduler();
+	if (current != NULL && sim_scheduler_chosen.load()) {
+		return current;
+	}
+	current = sim_default_task_scheduler();
+	btSetTaskScheduler(current);
+	return current;
+}
+#endif
+
+struct sim_ctrl_msg {
+	int vehicle;
+	struct sim_ctrl ctrl;
+};
+
+// single producer (game), single consumer (physics thread)
+struct sim_ctrl_queue {
+	struct sim_ctrl_msg msgs[SIM_CTRL_QUEUE_SZ];
+	std::atomic<unsigned> head;
+	std::atomic<unsigned> tail;
+
+	void reset()
+	{
+		head.store(0);
+		tail.store(0);
+	}
+
+	int push(struct sim_ctrl_msg* msg)
+	{
+		unsigned h = head.load(std::memory_order_relaxed);
+		unsigned t = tail.load(std::memory_order_acquire);
+		if ((h - t) == SIM_CTRL_QUEUE_SZ) return 0;
+		msgs[h % SIM_CTRL_QUEUE_SZ] = *msg;
+		head.store(h + 1, std::memory_order_release);
+		return 1;
+	}
+
+	int pop(struct sim_ctrl_msg* msg)
+	{
+		unsigned t = tail.load(std::memory_order_relaxed);
+		unsigned h = head.load(std::memory_order_acquire);
+		if (t == h) return 0;
+		*msg = msgs[t % SIM_CTRL_QUEUE_SZ];
+		tail.store(t + 1, std::memory_order_release);
+		return 1;
+	}
+};
+
+/* wait-free triple buffer: the writer owns `back`, the reader owns `front`,
+ * and the third slot is swapped through `middle`, which also carries a flag
+ * telling the reader whether it holds something newer than `front` */
+#define SIM_TRIPLE_FRESH (4)
+struct sim_pose_triple {
+	struct sim_poses slots[3];
+	int back;
+	int front;
+	std::atomic<int> middle;
+
+	void reset()
+	{
+		back = 0;
+		middle.store(1);
+		front = 2;
+	}
+
+	struct sim_poses* write_slot()
+	{
+		return &slots[back];
+	}
+
+	void publish()
+	{
+		back = middle.exchange(back | SIM_TRIPLE_FRESH, std::memory_order_acq_rel) & 3;
+	}
+
+	int latch()
+	{
+		if (!(middle.load(std::memory_order_relaxed) & SIM_TRIPLE_FRESH)) return 0;
+		front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+		return 1;
+	}
+
+	struct sim_poses* read_slot()
+	{
+		return &slots[front];
+	}
+};
+
+/* persistent worker threads for data parallel jobs; the calling thread
+ * takes part in every job, so n_threads == 1 starts no threads at all */
+struct sim_workers {
+	typedef void (*job_fn)(void* usr, int i);
+
+	std::thread** threads;
+	int n_threads;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	int generation;
+	int busy;
+	int quit;
+
+	job_fn fn;
+	void* usr;
+	int count;
+	std::atomic<int> next;
+
+	void start(int n)
+	{
+		ASSERT(n >= 1);
+		n_threads = n - 1;
+		generation = 0;
+		busy = 0;
+		quit = 0;
+		threads = new std::thread*[n_threads > 0 ? n_threads : 1];
+		for (int i = 0; i < n_threads; i++) {
+			threads[i] = new std::thread(&sim_workers::worker_main, this);
+		}
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = 1;
+		}
+		wake.notify_all();
+		for (int i = 0; i < n_threads; i++) {
+			threads[i]->join();
+			delete threads[i];
+		}
+		delete[] threads;
+		n_threads = 0;
+	}
+
+	void drain()
+	{
+		for (;;) {
+			int i = next.fetch_add(1);
+			if (i >= count) break;
+			fn(usr, i);
+		}
+	}
+
+	void worker_main()
+	{
+		int seen = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			wake.wait(lock, [&]{ return quit || generation != seen; });
+			if (quit) return;
+			seen = generation;
+			lock.unlock();
+			drain();
+			lock.lock();
+			if (--busy == 0) done.notify_one();
+		}
+	}
+
+	// runs fn(usr, i) for i in [0;count) and returns when all are done
+	void run(int job_count, job_fn job, void* job_usr)
+	{
+		fn = job;
+		usr = job_usr;
+		count = job_count;
+		next.store(0);
+		if (n_threads == 0) {
+			drain();
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			busy = n_threads;
+			generation++;
+		}
+		wake.notify_all();
+		drain();
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&]{ return busy == 0; });
+	}
+};
+
+/* track triangles [first;first+count) in one SIM_TRACK_CHUNK_SIZE tile;
+ * see sim_set_track_streaming() */
+struct sim_track_chunk {
+	int first;
+	int count;
+	btVector3 anchor; // the tile's corner; its vertices are relative to it
+	btVector3 aabb_min; // world coordinates
+	btVector3 aabb_max;
+};
+
+// ray vs two-sided triangle (Möller–Trumbore); t along from->to
+static bool ray_triangle(const btVector3& from, const btVector3& dir, const btVector3& a, const btVector3& b, const btVector3& c, btScalar* t)
+{
+	btVector3 e1 = b - a;
+	btVector3 e2 = c - a;
+	btVector3 p = dir.cross(e2);
+	btScalar det = e1.dot(p);
+	if (btFabs(det) < SIMD_EPSILON) return false;
+	btScalar inv_det = btScalar(1) / det;
+	btVector3 s = from - a;
+	btScalar u = s.dot(p) * inv_det;
+	if (u < 0 || u > 1) return false;
+	btVector3 q = s.cross(e1);
+	btScalar v = dir.dot(q) * inv_det;
+	if (v < 0 || u + v > 1) return false;
+	*t = e2.dot(q) * inv_det;
+	return true;
+}
+
+/* uniform XZ grid over the track triangles; each cell lists every triangle
+ * whose XZ bounds touch it. rays walk the cells they cross (2D DDA), so a
+ * short suspension ray only ever looks at a cell or two, however big the
+ * track is. each cell keeps its own copy of its triangles relative to its
+ * corner, and the ray is moved into that frame cell by cell, so the ray
+ * and triangle math stays near zero however far out the track goes. the
+ * cell size is a power of two and the corners are multiples of it, so
+ * that move is exact against a rebased origin. immutable once built, so
+ * safe to share and to query from any number of threads */
+struct sim_track_grid {
+	btScalar min_x, min_z; // multiples of cell_size
+	btScalar cell_size;
+	int nx, nz;
+	btAlignedObjectArray<int> cell_start; // nx*nz+1; CSR into cell_vertices
+	btAlignedObjectArray<btScalar> cell_vertices; // 9 per triangle, relative to its cell's corner
+
+	void cell_range(btScalar lo, btScalar hi, btScalar origin, int n, int* i0, int* i1)
+	{
+		*i0 = (int)((lo - origin) / cell_size);
+		*i1 = (int)((hi - origin) / cell_size);
+		if (*i0 < 0) *i0 = 0;
+		if (*i1 >= n) *i1 = n - 1;
+	}
+
+	btVector3 cell_corner(int ix, int iz) const
+	{
+		return btVector3(min_x + ix * cell_size, 0, min_z + iz * cell_size);
+	}
+
+	static void triangle_bounds(const btScalar* vertices, const int32_t* indices, int tri, btScalar* x0, btScalar* z0, btScalar* x1, btScalar* z1)
+	{
+		*x0 = *z0 = BT_LARGE_FLOAT;
+		*x1 = *z1 = -BT_LARGE_FLOAT;
+		for (int k = 0; k < 3; k++) {
+			const btScalar* v = &vertices[indices[tri*3+k]*3];
+			*x0 = btMin(*x0, v[0]);
+			*x1 = btMax(*x1, v[0]);
+			*z0 = btMin(*z0, v[2]);
+			*z1 = btMax(*z1, v[2]);
+		}
+	}
+
+	// vertices in world coordinates; nothing is kept pointing at them
+	void build(const btScalar* vertices, int n_vertices, const int32_t* indices, int n_triangles)
+	{
+		btScalar max_x, max_z;
+		min_x = min_z = BT_LARGE_FLOAT;
+		max_x = max_z = -BT_LARGE_FLOAT;
+		for (int i = 0; i < n_vertices; i++) {
+			min_x = btMin(min_x, vertices[i*3]);
+			max_x = btMax(max_x, vertices[i*3]);
+			min_z = btMin(min_z, vertices[i*3+2]);
+			max_z = btMax(max_z, vertices[i*3+2]);
+		}
+
+		// about a triangle across per cell, but not absurdly many cells
+		btScalar extent = 0;
+		for (int i = 0; i < n_triangles; i++) {
+			btScalar x0, z0, x1, z1;
+			triangle_bounds(vertices, indices, i, &x0, &z0, &x1, &z1);
+			extent += btMax(x1 - x0, z1 - z0);
+		}
+		cell_size = 0.5;
+		while (cell_size < extent / (btScalar)n_triangles) cell_size *= 2;
+		for (;;) {
+			btScalar x0 = (btScalar)floor(min_x / cell_size) * cell_size;
+			btScalar z0 = (btScalar)floor(min_z / cell_size) * cell_size;
+			nx = (int)((max_x - x0) / cell_size) + 1;
+			nz = (int)((max_z - z0) / cell_size) + 1;
+			if ((long)nx * (long)nz <= 4L * n_triangles + 1024) {
+				min_x = x0;
+				min_z = z0;
+				break;
+			}
+			cell_size *= 2;
+		}
+
+		// count, prefix sum, fill
+		int n_cells = nx * nz;
+		cell_start.resize(n_cells + 1);
+		for (int i = 0; i <= n_cells; i++) cell_start[i] = 0;
+		for (int pass = 0; pass < 2; pass++) {
+			for (int i = 0; i < n_triangles; i++) {
+				btScalar x0, z0, x1, z1;
+				triangle_bounds(vertices, indices, i, &x0, &z0, &x1, &z1);
+				int ix0, ix1, iz0, iz1;
+				cell_range(x0, x1, min_x, nx, &ix0, &ix1);
+				cell_range(z0, z1, min_z, nz, &iz0, &iz1);
+				for (int iz = iz0; iz <= iz1; iz++) {
+					for (int ix = ix0; ix <= ix1; ix++) {
+						int cell = iz * nx + ix;
+						if (pass == 0) {
+							cell_start[cell+1]++;
+							continue;
+						}
+						btVector3 corner = cell_corner(ix, iz);
+						btScalar* dst = &cell_vertices[(cell_start[cell]++) * 9];
+						for (int k = 0; k < 3; k++) {
+							const btScalar* v = &vertices[indices[i*3+k]*3];
+							for (int j = 0; j < 3; j++) dst[k*3+j] = v[j] - corner[j];
+						}
+					}
+				}
+			}
+			if (pass == 0) {
+				for (int c = 0; c < n_cells; c++) cell_start[c+1] += cell_start[c];
+				cell_vertices.resize(cell_start[n_cells] * 9);
+			} else {
+				// the fill moved every start up to the next cell's
+				for (int c = n_cells; c > 0; c--) cell_start[c] = cell_start[c-1];
+				cell_start[0] = 0;
+			}
+		}
+	}
+
+	// from is relative to the cell's corner
+	bool test_cell(int cell, const btVector3& from, const btVector3& dir, btScalar* best_t, int* best_entry) const
+	{
+		bool hit = false;
+		for (int i = cell_start[cell]; i < cell_start[cell+1]; i++) {
+			const btScalar* v = &cell_vertices[i*9];
+			btScalar t;
+			if (!ray_triangle(from, dir, btVector3(v[0],v[1],v[2]), btVector3(v[3],v[4],v[5]), btVector3(v[6],v[7],v[8]), &t)) continue;
+			if (t >= 0 && t < *best_t) {
+				*best_t = t;
+				*best_entry = i;
+				hit = true;
+			}
+		}
+		return hit;
+	}
+
+	/* nearest hit along from->to, which are relative to world position
+	 * offset (the sim's origin, or zero for world coordinates); fraction
+	 * in [0;1] and a unit normal facing back along the ray, like Bullet's
+	 * ray callbacks */
+	bool raycast(const btVector3& from, const btVector3& to, const btVector3& offset, btScalar* fraction, btVector3* normal) const
+	{
+		if (nx == 0) return false;
+		btVector3 dir = to - from;
+
+		// the cells are walked relative to the grid's corner
+		btVector3 g = from + (offset - cell_corner(0, 0));
+
+		// clip to the grid in XZ
+		btScalar t0 = 0, t1 = 1;
+		btScalar hi[2] = {nx * cell_size, nz * cell_size};
+		int axes[2] = {0, 2};
+		for (int k = 0; k < 2; k++) {
+			btScalar o = g[axes[k]];
+			btScalar d = dir[axes[k]];
+			if (btFabs(d) < SIMD_EPSILON) {
+				if (o < 0 || o > hi[k]) return false;
+				continue;
+			}
+			btScalar ta = -o / d;
+			btScalar tb = (hi[k] - o) / d;
+			if (ta > tb) btSwap(ta, tb);
+			t0 = btMax(t0, ta);
+			t1 = btMin(t1, tb);
+			if (t0 > t1) return false;
+		}
+
+		// Amanatides & Woo
+		btScalar x = g[0] + dir[0] * t0;
+		btScalar z = g[2] + dir[2] * t0;
+		int ix = btMin(btMax((int)(x / cell_size), 0), nx - 1);
+		int iz = btMin(btMax((int)(z / cell_size), 0), nz - 1);
+		int step_x = dir[0] > 0 ? 1 : -1;
+		int step_z = dir[2] > 0 ? 1 : -1;
+		btScalar inv_x = btFabs(dir[0]) > SIMD_EPSILON ? btScalar(1) / dir[0] : 0;
+		btScalar inv_z = btFabs(dir[2]) > SIMD_EPSILON ? btScalar(1) / dir[2] : 0;
+		btScalar next_x = inv_x != 0 ? ((ix + (step_x > 0 ? 1 : 0)) * cell_size - g[0]) * inv_x : BT_LARGE_FLOAT;
+		btScalar next_z = inv_z != 0 ? ((iz + (step_z > 0 ? 1 : 0)) * cell_size - g[2]) * inv_z : BT_LARGE_FLOAT;
+		btScalar delta_x = inv_x != 0 ? cell_size * btFabs(inv_x) : BT_LARGE_FLOAT;
+		btScalar delta_z = inv_z != 0 ? cell_size * btFabs(inv_z) : BT_LARGE_FLOAT;
+
+		btScalar best_t = t1;
+		int best_entry = -1;
+		for (;;) {
+			btVector3 local = from + (offset - cell_corner(ix, iz));
+			test_cell(iz * nx + ix, local, dir, &best_t, &best_entry);
+			btScalar cell_exit = btMin(next_x, next_z);
+			// a hit before leaving this cell can't be beaten further on
+			if (best_entry >= 0 && best_t <= cell_exit) break;
+			if (cell_exit >= t1) break;
+			if (next_x < next_z) {
+				ix += step_x;
+				next_x += delta_x;
+				if (ix < 0 || ix >= nx) break;
+			} else {
+				iz += step_z;
+				next_z += delta_z;
+				if (iz < 0 || iz >= nz) break;
+			}
+		}
+		if (best_entry < 0) return false;
+
+		const btScalar* v = &cell_vertices[best_entry*9];
+		btVector3 va(v[0],v[1],v[2]);
+		btVector3 n = (btVector3(v[3],v[4],v[5]) - va).cross(btVector3(v[6],v[7],v[8]) - va);
+		n.normalize();
+		if (n.dot(dir) > 0) n = -n;
+		*fraction = best_t;
+		*normal = n;
+		return true;
+	}
+};
+
+/* track collision; immutable once built, so several sims may share it (see
+ * sim_pool). the triangle meshes reference the arrays, so they live as long
+ * as the shapes do */
+struct sim_track_mesh {
+	/* three corners per triangle, grouped by chunk and relative to the
+	 * chunk's anchor, so contacts are worked out near zero wherever the
+	 * chunk is. the anchors are on multiples of SIM_TRACK_CHUNK_SIZE, so
+	 * placing a chunk against a rebased origin is exact */
+	btAlignedObjectArray<btScalar> vertices;
+	btAlignedObjectArray<int> corners; // 0, 1, 2, ...; every chunk's index array
+	btCompoundShape* shape; // the whole track; see get_shape()
+	btAlignedObjectArray<btTriangleIndexVertexArray*> shape_meshes;
+	btAlignedObjectArray<btBvhTriangleMeshShape*> shape_chunks;
+	struct sim_track_grid grid;
+	double build_time;
+
+	btScalar chunk_min_x, chunk_min_z;
+	int chunk_nx, chunk_nz;
+	btAlignedObjectArray<struct sim_track_chunk> chunks; // chunk_nx*chunk_nz
+
+	void build_chunks(const btScalar* world, int n_vertices, int32_t* in_indices, int n_triangles)
+	{
+		btScalar max_x, max_z;
+		chunk_min_x = chunk_min_z = BT_LARGE_FLOAT;
+		max_x = max_z = -BT_LARGE_FLOAT;
+		for (int i = 0; i < n_vertices; i++) {
+			chunk_min_x = btMin(chunk_min_x, world[i*3]);
+			max_x = btMax(max_x, world[i*3]);
+			chunk_min_z = btMin(chunk_min_z, world[i*3+2]);
+			max_z = btMax(max_z, world[i*3+2]);
+		}
+		chunk_min_x = (btScalar)floor(chunk_min_x / SIM_TRACK_CHUNK_SIZE) * SIM_TRACK_CHUNK_SIZE;
+		chunk_min_z = (btScalar)floor(chunk_min_z / SIM_TRACK_CHUNK_SIZE) * SIM_TRACK_CHUNK_SIZE;
+		chunk_nx = (int)((max_x - chunk_min_x) / SIM_TRACK_CHUNK_SIZE) + 1;
+		chunk_nz = (int)((max_z - chunk_min_z) / SIM_TRACK_CHUNK_SIZE) + 1;
+		int n_chunks = chunk_nx * chunk_nz;
+
+		// counting sort by the tile of the centroid
+		btAlignedObjectArray<int> tile;
+		tile.resize(n_triangles);
+		chunks.resize(n_chunks);
+		for (int c = 0; c < n_chunks; c++) {
+			chunks[c].first = 0;
+			chunks[c].count = 0;
+			chunks[c].anchor = btVector3(
+				chunk_min_x + (c % chunk_nx) * SIM_TRACK_CHUNK_SIZE,
+				0,
+				chunk_min_z + (c / chunk_nx) * SIM_TRACK_CHUNK_SIZE);
+			chunks[c].aabb_min = btVector3(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+			chunks[c].aabb_max = -chunks[c].aabb_min;
+		}
+		for (int i = 0; i < n_triangles; i++) {
+			btScalar x = 0, z = 0;
+			for (int k = 0; k < 3; k++) {
+				x += world[in_indices[i*3+k]*3];
+				z += world[in_indices[i*3+k]*3+2];
+			}
+			int ix = btMin((int)((x / 3 - chunk_min_x) / SIM_TRACK_CHUNK_SIZE), chunk_nx - 1);
+			int iz = btMin((int)((z / 3 - chunk_min_z) / SIM_TRACK_CHUNK_SIZE), chunk_nz - 1);
+			tile[i] = iz * chunk_nx + ix;
+			chunks[tile[i]].count++;
+		}
+		int first = 0;
+		int max_count = 0;
+		for (int c = 0; c < n_chunks; c++) {
+			chunks[c].first = first;
+			first += chunks[c].count;
+			max_count = btMax(max_count, chunks[c].count);
+			chunks[c].count = 0;
+		}
+		vertices.resize(n_triangles * 9);
+		for (int i = 0; i < n_triangles; i++) {
+			struct sim_track_chunk* chunk = &chunks[tile[i]];
+			int dst = chunk->first + chunk->count++;
+			for (int k = 0; k < 3; k++) {
+				const btScalar* v = &world[in_indices[i*3+k]*3];
+				btVector3 p(v[0], v[1], v[2]);
+				chunk->aabb_min.setMin(p);
+				chunk->aabb_max.setMax(p);
+				for (int j = 0; j < 3; j++) vertices[dst*9+k*3+j] = p[j] - chunk->anchor[j];
+			}
+		}
+		corners.resize(max_count * 3);
+		for (int i = 0; i < corners.size(); i++) corners[i] = i;
+	}
+
+	// a chunk's triangles for Bullet, in its anchor's frame; caller owns it
+	btTriangleIndexVertexArray* chunk_mesh(int c)
+	{
+		struct sim_track_chunk* chunk = &chunks[c];
+		ASSERT(chunk->count > 0);
+		return new btTriangleIndexVertexArray(
+			chunk->count,
+			&corners[0],
+			3 * sizeof(int),
+			chunk->count * 3,
+			&vertices[chunk->first * 9],
+			3 * sizeof(btScalar)
+		);
+	}
+
+	// the first tile's corner; where the whole track goes
+	btVector3 anchor() const
+	{
+		return btVector3(chunk_min_x, 0, chunk_min_z);
+	}
+
+	/* for sims that don't stream: every chunk's BVH at its anchor under
+	 * one compound, so contacts are relative to the chunk here too.
+	 * streaming sims never need it, so it's only built on demand. shared
+	 * by every sim on the mesh, so it mustn't go in the caller's arena */
+	btCompoundShape* get_shape()
+	{
+		if (shape == NULL) {
+			btClock clock;
+			struct sim_arena_scope heap(NULL);
+			shape = new btCompoundShape(true, chunks.size());
+			for (int c = 0; c < chunks.size(); c++) {
+				if (chunks[c].count == 0) continue;
+				btTriangleIndexVertexArray* mesh = chunk_mesh(c);
+				btBvhTriangleMeshShape* chunk_shape = new btBvhTriangleMeshShape(mesh, true);
+				shape_meshes.push_back(mesh);
+				shape_chunks.push_back(chunk_shape);
+				btTransform tx;
+				tx.setIdentity();
+				tx.setOrigin(chunks[c].anchor - anchor());
+				shape->addChildShape(tx, chunk_shape);
+			}
+			build_time += (double)clock.getTimeMicroseconds() * 1e-6;
+		}
+		return shape;
+	}
+
+	void build(struct vec3* in_vertices, int n_vertices, int32_t* in_indices, int n_triangles)
+	{
+		ASSERT(n_vertices > 0 && n_triangles > 0);
+
+		btClock clock;
+
+		// world coordinates; only the chunks' and grid's copies are kept
+		btAlignedObjectArray<btScalar> world;
+		world.resize(n_vertices * 3);
+		for (int i = 0; i < n_vertices; i++) {
+			for (int j = 0; j < 3; j++) {
+				world[i*3+j] = in_vertices[i].s[j];
+			}
+		}
+		for (int i = 0; i < n_triangles * 3; i++) {
+			ASSERT(in_indices[i] >= 0 && in_indices[i] < n_vertices);
+		}
+		build_chunks(&world[0], n_vertices, in_indices, n_triangles);
+		shape = NULL;
+		grid.build(&world[0], n_vertices, in_indices, n_triangles);
+
+		build_time = (double)clock.getTimeMicroseconds() * 1e-6;
+	}
+
+	void release()
+	{
+		delete shape;
+		for (int i = 0; i < shape_chunks.size(); i++) {
+			delete shape_chunks[i];
+			delete shape_meshes[i];
+		}
+		shape_chunks.clear();
+		shape_meshes.clear();
+	}
+};
+
+/* wheel rays go against the track grid and the ground plane directly; the
+ * world is only asked about dynamic bodies (other vehicles), and only when
+ * there are any. with the old per-block track everything goes to the
+ * world like btDefaultVehicleRaycaster did */
+struct sim_vehicle_raycaster : public btVehicleRaycaster {
+	struct sim* sim;
+	btRigidBody* self;
+
+	sim_vehicle_raycaster(struct sim* sim, btRigidBody* self) : sim(sim), self(self) {}
+
+	virtual void* castRay(const btVector3& from, const btVector3& to, btVehicleRaycasterResult& result);
+};
+
+// closest hit among non-static bodies, except the one casting
+struct sim_dynamic_ray_callback : public btCollisionWorld::ClosestRayResultCallback {
+	const btCollisionObject* self;
+
+	sim_dynamic_ray_callback(const btVector3& from, const btVector3& to, const btCollisionObject* self, bool dynamic_only) :
+		btCollisionWorld::ClosestRayResultCallback(from, to),
+		self(self)
+	{
+		if (dynamic_only) {
+			m_collisionFilterGroup = btBroadphaseProxy::DefaultFilter;
+			m_collisionFilterMask = btBroadphaseProxy::AllFilter ^ btBroadphaseProxy::StaticFilter;
+		}
+	}
+
+	virtual bool needsCollision(btBroadphaseProxy* proxy) const
+	{
+		if (proxy->m_clientObject == self) return false;
+		return btCollisionWorld::ClosestRayResultCallback::needsCollision(proxy);
+	}
+};
+
+// one streamed track chunk; all NULL while retired
+struct sim_track_chunk_body {
+	btTriangleIndexVertexArray* mesh;
+	btBvhTriangleMeshShape* shape;
+	btRigidBody* body;
+};
+
+// a collision object as sim_raycast_batch() sees it
+struct sim_ray_target {
+	btCollisionObject* object;
+	btVector3 bounds[2];
+	int vehicle;
+};
+
+#define SIM_CHASSIS_MASS (600)
+
+static const btVector3 sim_chassis_extents(0.3, 0.1, 1);
+
+// wheel layout of both backends; the first two steer and drive
+static const btVector3 sim_wheel_hardpoints[4] = {
+	btVector3(-0.5, 0.2, 1.6),
+	btVector3(0.5, 0.2, 1.6),
+	btVector3(-0.5, 0.2, -1.6),
+	btVector3(0.5, 0.2, -1.6),
+};
+
+// what a lite wheel carries from step to step
+struct sim_fleet_wheel_state {
+	btScalar suspension_length;
+	btScalar rotation;
+	btScalar delta_rotation;
+	btScalar engine_force;
+	btScalar brake;
+	btScalar steering;
+};
+
+/* the lightweight vehicle backend (see sim_add_lite_vehicle()): the same
+ * wheel layout and tuning as sim_vehicle::initialize(), but instead of a
+ * btRaycastVehicle per vehicle, all lite vehicles live in flat per-wheel
+ * arrays and one action updates all of them per step. only casting the
+ * rays and applying the summed impulses go body by body; suspension,
+ * tires and wheel spin are plain loops over the arrays. the tire model
+ * is btRaycastVehicle's without the bilateral constraint solve: every
+ * impulse comes from the velocities at the start of the step */
+struct sim_fleet : public btActionInterface {
+	struct sim* sim;
+	int n;
+	btCollisionShape* shape; // shared by every lite chassis
+
+	// per vehicle
+	btAlignedObjectArray<btRigidBody*> chassis;
+	btAlignedObjectArray<int> enabled; // 0 while far; see sim::update_lod()
+
+	// per wheel (4 per vehicle); tuning
+	btAlignedObjectArray<btScalar> rest_length;
+	btAlignedObjectArray<btScalar> stiffness;
+	btAlignedObjectArray<btScalar> relaxation;
+	btAlignedObjectArray<btScalar> compression;
+	btAlignedObjectArray<btScalar> friction_slip;
+	btAlignedObjectArray<btScalar> roll_influence;
+	// controls and state kept between steps
+	btAlignedObjectArray<btScalar> engine_force;
+	btAlignedObjectArray<btScalar> brake;
+	btAlignedObjectArray<btScalar> steering;
+	btAlignedObjectArray<btScalar> rotation;
+	btAlignedObjectArray<btScalar> delta_rotation;
+	btAlignedObjectArray<btScalar> suspension_length;
+	// scratch, redone every step
+	btAlignedObjectArray<btScalar> contact; // 1 or 0, so it can multiply
+	btAlignedObjectArray<btScalar> side_mass; // effective mass along side
+	btAlignedObjectArray<btScalar> forward_mass;
+	btAlignedObjectArray<btScalar> suspension_force;
+	btAlignedObjectArray<btScalar> side_impulse;
+	btAlignedObjectArray<btScalar> forward_impulse;
+	btAlignedObjectArray<btVector3> hardpoint;
+	btAlignedObjectArray<btVector3> direction;
+	btAlignedObjectArray<btVector3> contact_point;
+	btAlignedObjectArray<btVector3> contact_normal;
+	btAlignedObjectArray<btVector3> velocity; // chassis, at the contact
+	btAlignedObjectArray<btVector3> side;
+	btAlignedObjectArray<btVector3> forward;
+
+	void initialize(struct sim* in_sim)
+	{
+		sim = in_sim;
+		n = 0;
+		shape = new btBoxShape(sim_chassis_extents);
+	}
+
+	int add(btRigidBody* body)
+	{
+		chassis.push_back(body);
+		enabled.push_back(1);
+		int nw = (n + 1) * 4;
+		btAlignedObjectArray<btScalar>* scalars[] = {
+			&rest_length, &stiffness, &relaxation, &compression, &friction_slip, &roll_influence,
+			&engine_force, &brake, &steering, &rotation, &delta_rotation, &suspension_length,
+			&contact, &side_mass, &forward_mass, &suspension_force, &side_impulse, &forward_impulse,
+		};
+		for (size_t k = 0; k < sizeof(scalars) / sizeof(scalars[0]); k++) scalars[k]->resize(nw, 0);
+		btAlignedObjectArray<btVector3>* vectors[] = {
+			&hardpoint, &direction, &contact_point, &contact_normal, &velocity, &side, &forward,
+		};
+		for (size_t k = 0; k < sizeof(vectors) / sizeof(vectors[0]); k++) vectors[k]->resize(nw, btVector3(0,0,0));
+
+		struct sim_vehicle_tuning defaults;
+		sim_vehicle_tuning_default(&defaults);
+		set_tuning(n, &defaults);
+		for (int k = 0; k < 4; k++) suspension_length[n*4+k] = defaults.suspension_rest_length;
+		return n++;
+	}
+
+	// every array back to empty; see sim::teardown()
+	void clear()
+	{
+		chassis.clear();
+		enabled.clear();
+		btAlignedObjectArray<btScalar>* scalars[] = {
+			&rest_length, &stiffness, &relaxation, &compression, &friction_slip, &roll_influence,
+			&engine_force, &brake, &steering, &rotation, &delta_rotation, &suspension_length,
+			&contact, &side_mass, &forward_mass, &suspension_force, &side_impulse, &forward_impulse,
+		};
+		for (size_t k = 0; k < sizeof(scalars) / sizeof(scalars[0]); k++) scalars[k]->clear();
+		btAlignedObjectArray<btVector3>* vectors[] = {
+			&hardpoint, &direction, &contact_point, &contact_normal, &velocity, &side, &forward,
+		};
+		for (size_t k = 0; k < sizeof(vectors) / sizeof(vectors[0]); k++) vectors[k]->clear();
+		n = 0;
+	}
+
+	void set_tuning(int i, struct sim_vehicle_tuning* t)
+	{
+		for (int w = i*4; w < i*4+4; w++) {
+			rest_length[w] = t->suspension_rest_length;
+			stiffness[w] = t->suspension_stiffness;
+			relaxation[w] = t->damping_relaxation;
+			compression[w] = t->damping_compression;
+			friction_slip[w] = t->friction_slip;
+			roll_influence[w] = t->roll_influence;
+		}
+	}
+
+	// same forces as sim_vehicle::ctrl()
+	void ctrl(int i, const struct sim_ctrl* c)
+	{
+		for (int k = 0; k < 2; k++) {
+			engine_force[i*4+k] = c->accel ? 1000 : 0;
+			steering[i*4+k] = (float)c->steer * -0.4f;
+			brake[i*4+2+k] = c->brake ? 100 : 0;
+		}
+	}
+
+	// per vehicle: wheel frames, rays, and the ground frame at each contact
+	void cast(int i)
+	{
+		btRigidBody* body = chassis[i];
+		const btTransform& tx = body->getCenterOfMassTransform();
+		const btVector3& center = body->getCenterOfMassPosition();
+		const btMatrix3x3& inv_inertia = body->getInvInertiaTensorWorld();
+		btScalar inv_mass = body->getInvMass();
+		btVector3 down = tx.getBasis() * btVector3(0,-1,0);
+		btVector3 axle_cs = tx.getBasis() * btVector3(-1,0,0);
+		sim_vehicle_raycaster raycaster(sim, body);
+
+		for (int k = 0; k < 4; k++) {
+			int w = i*4+k;
+			if (!enabled[i]) {
+				// no contact, so none of the below counts
+				contact[w] = 0;
+				suspension_force[w] = 0;
+				continue;
+			}
+			hardpoint[w] = tx * sim_wheel_hardpoints[k];
+			direction[w] = down;
+			btScalar ray_length = rest_length[w] + WHEEL_RADIUS;
+			btVector3 to = hardpoint[w] + down * ray_length;
+
+			btVehicleRaycaster::btVehicleRaycasterResult hit;
+			if (raycaster.castRay(hardpoint[w], to, hit) == NULL) {
+				contact[w] = 0;
+				suspension_length[w] = rest_length[w];
+				contact_point[w] = to;
+				contact_normal[w] = -down;
+				velocity[w].setZero();
+				side[w].setZero();
+				forward[w].setZero();
+				side_mass[w] = 0;
+				forward_mass[w] = 0;
+				continue;
+			}
+
+			contact[w] = 1;
+			btScalar length = hit.m_distFraction * ray_length - WHEEL_RADIUS;
+			length = btMax(length, rest_length[w] - SIM_FLEET_MAX_TRAVEL);
+			length = btMin(length, rest_length[w] + SIM_FLEET_MAX_TRAVEL);
+			suspension_length[w] = length;
+			contact_point[w] = hit.m_hitPointInWorld;
+			contact_normal[w] = hit.m_hitNormalInWorld;
+			btVector3 r = contact_point[w] - center;
+			velocity[w] = body->getVelocityInLocalPoint(r);
+
+			// steered axle flattened onto the ground
+			btVector3 axle = btMatrix3x3(btQuaternion(-down, steering[w])) * axle_cs;
+			btVector3 s = axle - contact_normal[w] * axle.dot(contact_normal[w]);
+			btScalar len2 = s.length2();
+			side[w] = len2 > SIMD_EPSILON ? s / btSqrt(len2) : btVector3(0,0,0);
+			forward[w] = contact_normal[w].cross(side[w]);
+
+			// 1 / (J M^-1 J^T) against the static ground
+			btVector3 rs = r.cross(side[w]);
+			btVector3 rf = r.cross(forward[w]);
+			side_mass[w] = btScalar(1) / (inv_mass + rs.dot(inv_inertia * rs));
+			forward_mass[w] = btScalar(1) / (inv_mass + rf.dot(inv_inertia * rf));
+		}
+	}
+
+	virtual void updateAction(btCollisionWorld* world, btScalar dt)
+	{
+		(void)world;
+		int nw = n * 4;
+		for (int i = 0; i < n; i++) cast(i);
+
+		// suspension, like btRaycastVehicle::updateSuspension()
+		btScalar mass = SIM_CHASSIS_MASS;
+		for (int w = 0; w < nw; w++) {
+			btScalar denominator = contact_normal[w].dot(direction[w]);
+			btScalar inv = denominator < btScalar(-0.1) ? btScalar(-1) / denominator : btScalar(10);
+			btScalar rel_vel = denominator < btScalar(-0.1) ? contact_normal[w].dot(velocity[w]) * inv : btScalar(0);
+			btScalar force = stiffness[w] * (rest_length[w] - suspension_length[w]) * inv;
+			force -= (rel_vel < 0 ? compression[w] : relaxation[w]) * rel_vel;
+			force = btMax(force * mass, btScalar(0));
+			suspension_force[w] = contact[w] * btMin(force, btScalar(SIM_FLEET_MAX_SUSPENSION_FORCE));
+		}
+
+		// tires: side grip, engine or brake, then the friction circle
+		for (int w = 0; w < nw; w++) {
+			btScalar side_vel = side[w].dot(velocity[w]);
+			btScalar forward_vel = forward[w].dot(velocity[w]);
+			btScalar s = btScalar(-0.2) * side_vel * side_mass[w];
+			btScalar f = -forward_vel * forward_mass[w];
+			f = btMax(btMin(f, brake[w]), -brake[w]);
+			if (engine_force[w] != 0) f = engine_force[w] * dt;
+
+			btScalar max_impulse = suspension_force[w] * dt * friction_slip[w];
+			btScalar x = f * btScalar(0.5);
+			btScalar sq = x*x + s*s;
+			btScalar skid = sq > max_impulse * max_impulse ? max_impulse / btSqrt(sq) : btScalar(1);
+			side_impulse[w] = contact[w] * s * skid;
+			forward_impulse[w] = contact[w] * f * skid;
+		}
+
+		// summed up per chassis; one linear and one angular impulse each
+		for (int i = 0; i < n; i++) {
+			if (!enabled[i]) continue;
+			btRigidBody* body = chassis[i];
+			const btVector3& center = body->getCenterOfMassPosition();
+			btVector3 linear(0,0,0);
+			btVector3 angular(0,0,0);
+			for (int w = i*4; w < i*4+4; w++) {
+				if (contact[w] == 0) continue;
+				btVector3 r = contact_point[w] - center;
+				btVector3 j = contact_normal[w] * (suspension_force[w] * dt) + forward[w] * forward_impulse[w];
+				linear += j;
+				angular += r.cross(j);
+				// roll influence: side impulses act closer to the center of mass
+				btVector3 up = -direction[w];
+				btVector3 rs = r - up * (up.dot(r) * (1 - roll_influence[w]));
+				btVector3 js = side[w] * side_impulse[w];
+				linear += js;
+				angular += rs.cross(js);
+			}
+			body->applyCentralImpulse(linear);
+			body->applyTorqueImpulse(angular);
+		}
+
+		// wheel spin, for drawing; far wheels are spun by the path
+		for (int w = 0; w < nw; w++) {
+			if (!enabled[w/4]) continue;
+			btScalar rolling = forward[w].dot(velocity[w]) * dt / WHEEL_RADIUS;
+			delta_rotation[w] = contact[w] != 0 ? rolling : delta_rotation[w] * btScalar(0.99);
+			rotation[w] += delta_rotation[w];
+		}
+	}
+
+	virtual void debugDraw(btIDebugDraw* draw)
+	{
+		(void)draw;
+	}
+
+	// like btRaycastVehicle::updateWheelTransform(), from the current chassis
+	void capture_state(int i, struct sim_vehicle_state* state)
+	{
+		const btTransform& tx = chassis[i]->getWorldTransform();
+		state->chassis = tx;
+		btVector3 down = tx.getBasis() * btVector3(0,-1,0);
+		btVector3 axle = tx.getBasis() * btVector3(-1,0,0);
+		for (int k = 0; k < 4; k++) {
+			int w = i*4+k;
+			btVector3 hp = tx * sim_wheel_hardpoints[k];
+			btMatrix3x3 steer(btQuaternion(-down, steering[w]));
+			btMatrix3x3 spin(btQuaternion(axle, -rotation[w]));
+			state->wheels[k].setBasis(steer * spin * tx.getBasis());
+			state->wheels[k].setOrigin(hp + down * suspension_length[w]);
+			state->wheel_hardpoints[k] = hp;
+			state->wheel_directions[k] = down;
+		}
+	}
+
+	void save(int i, struct sim_fleet_wheel_state* out)
+	{
+		for (int k = 0; k < 4; k++) {
+			int w = i*4+k;
+			out[k].suspension_length = suspension_length[w];
+			out[k].rotation = rotation[w];
+			out[k].delta_rotation = delta_rotation[w];
+			out[k].engine_force = engine_force[w];
+			out[k].brake = brake[w];
+			out[k].steering = steering[w];
+		}
+	}
+
+	void load(int i, const struct sim_fleet_wheel_state* in)
+	{
+		for (int k = 0; k < 4; k++) {
+			int w = i*4+k;
+			suspension_length[w] = in[k].suspension_length;
+			rotation[w] = in[k].rotation;
+			delta_rotation[w] = in[k].delta_rotation;
+			engine_force[w] = in[k].engine_force;
+			brake[w] = in[k].brake;
+			steering[w] = in[k].steering;
+		}
+	}
+};
+
+struct sim_vehicle {
+	struct sim* sim;
+	int index;
+	btRaycastVehicle::btVehicleTuning tuning;
+	btVehicleRaycaster* vehicleRayraster;
+	btRaycastVehicle* raycastVehicle; // NULL for lite vehicles
+	struct sim_fleet* fleet; // lite vehicles only
+	int fleet_index;
+	btRigidBody* chassis;
+	btVector3 chassis_extents;
+
+	// physics LOD; see sim::update_lod()
+	int far;
+	btScalar lod_s; // arc length along the path
+	btScalar lod_speed; // along the path; lod_velocity's z
+	btVector3 lod_velocity; // linear, in the path frame at handover
+	btVector3 lod_angular; // likewise
+	btScalar lod_lateral; // along the path frame's x
+	btScalar lod_clearance; // chassis above the ground
+	btQuaternion lod_offset; // chassis rotation in the path frame
+
+	// shape is NULL for a chassis of its own
+	btRigidBody* make_chassis(btDynamicsWorld* world, btTransform& tx, btCollisionShape* shape)
+	{
+		chassis_extents = sim_chassis_extents;
+		if (shape == NULL) shape = new btBoxShape(chassis_extents);
+
+		float mass = SIM_CHASSIS_MASS;
+		btVector3 local_inertia(0,0,0);
+		shape->calculateLocalInertia(mass, local_inertia);
+
+		btDefaultMotionState* mstate = new btDefaultMotionState(tx);
+		btRigidBody::btRigidBodyConstructionInfo cinfo(mass, mstate, shape, local_inertia);
+		btRigidBody* body = new btRigidBody(cinfo);
+		body->setContactProcessingThreshold(SIM_CHASSIS_CONTACT_THRESHOLD); // ???
+		world->addRigidBody(body);
+		body->setActivationState(DISABLE_DEACTIVATION);
+		return body;
+	}
+
+	void initialize_lite(btDynamicsWorld* world, btTransform& tx, struct sim_fleet* in_fleet)
+	{
+		fleet = in_fleet;
+		chassis = make_chassis(world, tx, fleet->shape);
+		chassis->setUserPointer(this); // see collect_ray_targets()
+		vehicleRayraster = NULL;
+		raycastVehicle = NULL;
+		fleet_index = fleet->add(chassis);
+	}
+
+	void initialize(btDynamicsWorld* world, btTransform& tx)
+	{
+		fleet = NULL;
+		fleet_index = -1;
+		chassis = make_chassis(world, tx, NULL);
+		chassis->setUserPointer(this); // see collect_ray_targets()
+		vehicleRayraster = new sim_vehicle_raycaster(sim, chassis);
+		raycastVehicle = new btRaycastVehicle(tuning, chassis, vehicleRayraster);
+		world->addVehicle(raycastVehicle);
+		raycastVehicle->setCoordinateSystem(0,1,2);
+		btVector3 dir(0,-1,0);
+		btVector3 axle(-1,0,0);
+		float suspension_rest_length = 0.6;
+		for (int i = 0; i < 4; i++) {
+			bool is_front_wheel = i < 2;
+			raycastVehicle->addWheel(sim_wheel_hardpoints[i], dir, axle, suspension_rest_length, WHEEL_RADIUS, tuning, is_front_wheel);
+		}
+
+		struct sim_vehicle_tuning defaults;
+		sim_vehicle_tuning_default(&defaults);
+		set_tuning(&defaults);
+		//raycastVehicle->getRigidBody()->applyImpulse(btVector3(-22,-2,-2), btVector3(10,0,0));
+	}
+
+	void set_tuning(struct sim_vehicle_tuning* t)
+	{
+		if (fleet != NULL) {
+			fleet->set_tuning(fleet_index, t);
+			return;
+		}
+		for (int i = 0; i < raycastVehicle->getNumWheels(); i++) {
+			btWheelInfo& wheel = raycastVehicle->getWheelInfo(i);
+			wheel.m_suspensionRestLength1 = t->suspension_rest_length;
+			wheel.m_suspensionStiffness = t->suspension_stiffness;
+			wheel.m_wheelsDampingRelaxation = t->damping_relaxation;
+			wheel.m_wheelsDampingCompression = t->damping_compression;
+			wheel.m_frictionSlip = t->friction_slip;
+			wheel.m_rollInfluence = t->roll_influence;
+		}
+	}
+
+	void ctrl(const struct sim_ctrl* c)
+	{
+		if (fleet != NULL) {
+			fleet->ctrl(fleet_index, c);
+			return;
+		}
+		float aforce = c->accel ? 1000 : 0;
+		float bforce = c->brake ? 100 : 0;
+		for (int w = 0; w < 2; w++) {
+			raycastVehicle->applyEngineForce(aforce, w);
+			raycastVehicle->setSteeringValue((float)c->steer * -0.4f, w);
+
+			raycastVehicle->setBrake(bforce, w+2);
+		}
+		//printf("%f\n", raycastVehicle->getCurrentSpeedKmHour());
+	}
+
+	void capture_state(struct sim_vehicle_state* state)
+	{
+		if (fleet != NULL) {
+			fleet->capture_state(fleet_index, state);
+			return;
+		}
+		state->chassis = chassis->getWorldTransform();
+		for (int w = 0; w < 4; w++) {
+			raycastVehicle->updateWheelTransform(w, true);
+			btWheelInfo& wheel = raycastVehicle->getWheelInfo(w);
+			state->wheels[w] = wheel.m_worldTransform;
+			state->wheel_hardpoints[w] = wheel.m_raycastInfo.m_hardPointWS;
+			state->wheel_directions[w] = wheel.m_raycastInfo.m_wheelDirectionWS;
+		}
+	}
+
+	// turns the wheels as if rolling at speed; for far vehicles
+	void spin_wheels(btScalar speed, btScalar dt)
+	{
+		btScalar delta = speed * dt / WHEEL_RADIUS;
+		for (int w = 0; w < 4; w++) {
+			if (fleet != NULL) {
+				fleet->delta_rotation[fleet_index*4+w] = delta;
+				fleet->rotation[fleet_index*4+w] += delta;
+			} else {
+				btWheelInfo& wheel = raycastVehicle->getWheelInfo(w);
+				wheel.m_deltaRotation = delta;
+				wheel.m_rotation += delta;
+			}
+		}
+	}
+
+	// the wheels part of struct sim_snapshot_vehicle
+	void save_wheels(struct sim_snapshot_cursor* cur)
+	{
+		if (fleet != NULL) {
+			struct sim_fleet_wheel_state wheels[4];
+			fleet->save(fleet_index, wheels);
+			cur->put(wheels, sizeof(wheels));
+			// same size as the full vehicle's wheels
+			static const char pad[sizeof(btWheelInfo) * 4 - sizeof(wheels)] = {0};
+			cur->put(pad, sizeof(pad));
+			return;
+		}
+		for (int w = 0; w < 4; w++) cur->put(&raycastVehicle->getWheelInfo(w), sizeof(btWheelInfo));
+	}
+
+	void load_wheels(struct sim_snapshot_cursor* cur)
+	{
+		if (fleet != NULL) {
+			struct sim_fleet_wheel_state wheels[4];
+			cur->get(wheels, sizeof(wheels));
+			cur->skip(sizeof(btWheelInfo) * 4 - sizeof(wheels));
+			fleet->load(fleet_index, wheels);
+			return;
+		}
+		for (int w = 0; w < 4; w++) cur->get(&raycastVehicle->getWheelInfo(w), sizeof(btWheelInfo));
+	}
+};
+
+/* the track's center line as a polyline with arc lengths, in world
+ * coordinates; far vehicles move along it by distance */
+struct sim_lod_path {
+	btAlignedObjectArray<btVector3> points; // closed: the first again at the end
+	btAlignedObjectArray<btScalar> s; // arc length at each point
+	btScalar length;
+	int closed;
+
+	/* XZ grid over the segments (i, i+1); each cell lists the segments
+	 * whose XZ bounds touch it, CSR like sim_track_grid */
+	btScalar min_x, min_z;
+	btScalar cell_size;
+	int nx, nz;
+	btAlignedObjectArray<int> cell_start;
+	btAlignedObjectArray<int> cell_segments;
+
+	// clamped both ways; project() asks about points off the grid too
+	void cell_range(btScalar lo, btScalar hi, btScalar origin, int n, int* i0, int* i1) const
+	{
+		*i0 = lo < origin ? 0 : btMin(n - 1, (int)((lo - origin) / cell_size));
+		*i1 = hi < origin ? 0 : btMin(n - 1, (int)((hi - origin) / cell_size));
+	}
+
+	void build_grid()
+	{
+		cell_start.clear();
+		cell_segments.clear();
+		int n_segments = points.size() - 1;
+		btScalar max_x, max_z;
+		min_x = max_x = points[0][0];
+		min_z = max_z = points[0][2];
+		for (int i = 1; i < points.size(); i++) {
+			min_x = btMin(min_x, points[i][0]);
+			max_x = btMax(max_x, points[i][0]);
+			min_z = btMin(min_z, points[i][2]);
+			max_z = btMax(max_z, points[i][2]);
+		}
+		cell_size = SIM_LOD_PATH_CELL;
+		btScalar extent = btMax(max_x - min_x, max_z - min_z);
+		if (extent / cell_size >= SIM_LOD_PATH_CELLS_MAX) cell_size = extent / (SIM_LOD_PATH_CELLS_MAX - 1);
+		nx = (int)((max_x - min_x) / cell_size) + 1;
+		nz = (int)((max_z - min_z) / cell_size) + 1;
+
+		// count, prefix sum, fill
+		cell_start.resize(nx * nz + 1, 0);
+		for (int pass = 0; pass < 2; pass++) {
+			btAlignedObjectArray<int> fill;
+			if (pass == 1) {
+				for (int c = 0; c < nx * nz; c++) cell_start[c+1] += cell_start[c];
+				cell_segments.resize(cell_start[nx * nz]);
+				fill.resize(nx * nz);
+				for (int c = 0; c < nx * nz; c++) fill[c] = cell_start[c];
+			}
+			for (int i = 0; i < n_segments; i++) {
+				const btVector3& a = points[i];
+				const btVector3& b = points[i+1];
+				int x0, x1, z0, z1;
+				cell_range(btMin(a[0], b[0]), btMax(a[0], b[0]), min_x, nx, &x0, &x1);
+				cell_range(btMin(a[2], b[2]), btMax(a[2], b[2]), min_z, nz, &z0, &z1);
+				for (int z = z0; z <= z1; z++) {
+					for (int x = x0; x <= x1; x++) {
+						int c = x + z * nx;
+						if (pass == 0) {
+							cell_start[c+1]++;
+						} else {
+							cell_segments[fill[c]++] = i;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// squared distance from p to segment i, and where along it
+	btScalar segment_distance2(int i, const btVector3& p, btScalar* t) const
+	{
+		btVector3 d = points[i+1] - points[i];
+		btScalar len2 = d.length2();
+		*t = len2 > 0 ? (p - points[i]).dot(d) / len2 : 0;
+		*t = btMax(btMin(*t, btScalar(1)), btScalar(0));
+		return (points[i] + d * *t).distance2(p);
+	}
+
+	void set(const struct vec3* in, int n, int in_closed)
+	{
+		points.clear();
+		s.clear();
+		length = 0;
+		closed = 0;
+		if (n < 2) return;
+		closed = in_closed;
+		for (int i = 0; i < n; i++) points.push_back(btVector3(in[i].s[0], in[i].s[1], in[i].s[2]));
+		if (closed) points.push_back(points[0]);
+		s.push_back(0);
+		for (int i = 1; i < points.size(); i++) {
+			length += points[i].distance(points[i-1]);
+			s.push_back(length);
+		}
+		build_grid();
+	}
+
+	bool valid() const
+	{
+		return length > 0;
+	}
+
+	btScalar wrap(btScalar at) const
+	{
+		if (!closed) return btMax(btMin(at, length), btScalar(0));
+		at = btFmod(at, length);
+		return at < 0 ? at + length : at;
+	}
+
+	/* position and frame at arc length at: z along the path, x level and
+	 * to the left, y up-ish */
+	void frame(btScalar at, btVector3* p, btMatrix3x3* basis) const
+	{
+		at = wrap(at);
+		int lo = 0;
+		int hi = points.size() - 1;
+		while (hi - lo > 1) {
+			int mid = (lo + hi) / 2;
+			if (s[mid] <= at) {
+				lo = mid;
+			} else {
+				hi = mid;
+			}
+		}
+		btScalar seg = s[hi] - s[lo];
+		*p = points[lo].lerp(points[hi], seg > 0 ? (at - s[lo]) / seg : 0);
+
+		btVector3 z = points[hi] - points[lo];
+		z = z.length2() > SIMD_EPSILON ? z.normalized() : btVector3(0,0,1);
+		btVector3 x = btVector3(0,1,0).cross(z);
+		x = x.length2() > SIMD_EPSILON ? x.normalized() : btVector3(1,0,0);
+		btVector3 y = z.cross(x);
+		basis->setValue(
+			x[0], y[0], z[0],
+			x[1], y[1], z[1],
+			x[2], y[2], z[2]);
+	}
+
+	/* arc length of the nearest point. walks rings of cells out from p's
+	 * cell; segments not seen yet are at least r cells away in XZ after
+	 * ring r, so it stops once the best is closer than that. ties go to
+	 * the lowest segment index, so the answer doesn't depend on cell order */
+	btScalar project(const btVector3& p) const
+	{
+		int cx, cz;
+		cell_range(p[0], p[0], min_x, nx, &cx, &cx);
+		cell_range(p[2], p[2], min_z, nz, &cz, &cz);
+		btScalar best = BT_LARGE_FLOAT;
+		int best_i = -1;
+		btScalar best_t = 0;
+		int r_max = btMax(nx, nz);
+		for (int r = 0; r <= r_max; r++) {
+			for (int z = cz - r; z <= cz + r; z++) {
+				if (z < 0 || z >= nz) continue;
+				// the ring only: every x on its top and bottom rows, the two ends elsewhere
+				int step = (z == cz - r || z == cz + r) ? 1 : btMax(1, 2 * r);
+				for (int x = cx - r; x <= cx + r; x += step) {
+					if (x < 0 || x >= nx) continue;
+					int c = x + z * nx;
+					for (int k = cell_start[c]; k < cell_start[c+1]; k++) {
+						int i = cell_segments[k];
+						btScalar t;
+						btScalar d2 = segment_distance2(i, p, &t);
+						if (d2 < best || (d2 == best && i < best_i)) {
+							best = d2;
+							best_i = i;
+							best_t = t;
+						}
+					}
+				}
+			}
+			btScalar reach = (btScalar)r * cell_size;
+			if (best_i >= 0 && best <= reach * reach) break;
+		}
+		if (best_i < 0) return 0;
+		return s[best_i] + (s[best_i+1] - s[best_i]) * best_t;
+	}
+};
+
+// world, interpolation and motion state transforms at once
+static void sim_place_body(btRigidBody* body, const btTransform& tx)
+{
+	body->setWorldTransform(tx);
+	body->setInterpolationWorldTransform(tx);
+	if (body->getMotionState() != NULL) body->getMotionState()->setWorldTransform(tx);
+}
+
+struct sim {
+	class btDynamicsWorld* world;
+	class btConstraintSolver* constraintSolver;
+	class btBroadphaseInterface* overlappingPairCache;
+	class btCollisionDispatcher* dispatcher;
+	class btCollisionConfiguration* collisionConfiguration;
+	class btConstraintSolver* solverPool; // NULL unless multithreaded
+	btAlignedObjectArray<btConstraintSolver*> pool_solvers; // solverPool's; for their seeds
+	int n_threads;
+
+	btAlignedObjectArray<struct sim_vehicle*> vehicles;
+	struct sim_fleet fleet; // lite vehicles; in the world once there are any
+
+	struct sim_track_mesh* track_mesh;
+	int own_track_mesh; // 0 when shared by a sim_pool
+	btRigidBody* track_body; // not in the world when streaming
+	btRigidBody* ground_body;
+	btScalar ground_height; // top of the ground box
+
+	/* world position of the sim's zero; the blocks are in world
+	 * coordinates, the track's chunks and grid cells relative to their
+	 * own anchors, everything else is relative to this. see rebase() */
+	btVector3 origin;
+	btVector3 frame_origin; // origin of the latched poses; reader side
+	int n_blocks; // add_block(); the old per-slice track collision
+
+	// see sim_set_track_streaming()
+	btScalar stream_radius;
+	btAlignedObjectArray<struct sim_track_chunk_body> chunk_bodies;
+	btAlignedObjectArray<int> active_chunks;
+	int retire_cursor;
+
+	// rebuild_broadphase() and snapshot() scratch; kept to not allocate
+	btAlignedObjectArray<btRigidBody*> rebuild_bodies;
+	btAlignedObjectArray<int> rebuild_filters; // group and mask per body
+	btAlignedObjectArray<struct sim_manifold_copy> rebuild_contacts;
+	btManifoldArray rebuild_manifolds;
+
+	// see sim_set_lod_path(); the focus is in world coordinates
+	struct sim_lod_path lod_path;
+	std::mutex lod_mutex;
+	btVector3 lod_focus;
+	btVector3 lod_direction;
+	int lod_focus_set;
+	int n_far;
+
+	struct sim_arena arena; // see struct sim_arena
+
+	double track_build_time;
+	double step_time;
+	int step_count;
+
+	float fixed_dt;
+	double accumulator;
+
+	// see sim_set_step_budget()
+	double step_budget;
+	double step_cost; // moving average of one step_fixed(), seconds
+	double time_dropped; // real time never simulated, seconds
+	double time_scale; // moving average of sim time / real time
+
+	int quality;
+	int quality_auto;
+	double quality_timer; // real time since the last auto decision
+	double quality_time_dropped; // time_dropped at the last auto decision
+	btAlignedObjectArray<struct sim_vehicle_state> state_prev;
+	btAlignedObjectArray<struct sim_vehicle_state> state_cur;
+
+	// threaded mode; see sim_thread_start()
+	std::thread* thread;
+	std::atomic<int> thread_running;
+	struct sim_ctrl_queue ctrl_queue;
+	struct sim_pose_triple poses;
+
+	// interpolated poses for the current frame; reader side only
+	// (chassis and wheel transforms live in frame_transforms instead)
+	btAlignedObjectArray<struct sim_vehicle_pose> frame_poses;
+	struct sim_transform_buffer frame_transforms;
+
+	// sim_raycast_batch(); the targets are gathered up front so the
+	// workers never touch the world's own (unsynchronized) ray machinery
+	struct sim_workers query_workers;
+	int query_workers_started;
+	btAlignedObjectArray<struct sim_ray_target> ray_targets;
+	const struct sim_ray* batch_rays;
+	struct sim_ray_hit* batch_hits;
+	int batch_n;
+
+	void _initialize_world()
+	{
+		btVector3 worldMin(-WORLD_MAX, -WORLD_MAX, -WORLD_MAX);
+		btVector3 worldMax(WORLD_MAX, WORLD_MAX, WORLD_MAX);
+		overlappingPairCache = new btAxisSweep3(worldMin, worldMax);
+
+		collisionConfiguration = new btDefaultCollisionConfiguration();
+		solverPool = NULL;
+
+		#ifdef SIM_MT
+		if (n_threads > 1) {
+			_initialize_world_mt();
+			return;
+		}
+		#endif
+
+		n_threads = 1;
+
+		dispatcher = new btCollisionDispatcher(collisionConfiguration);
+		constraintSolver = new btSequentialImpulseConstraintSolver();
+
+		world = new btDiscreteDynamicsWorld(
+			dispatcher,
+			overlappingPairCache,
+			constraintSolver,
+			collisionConfiguration
+		);
+
+		world->setGravity(btVector3(0,-10,0));
+	}
+
+	#ifdef SIM_MT
+	void _initialize_world_mt()
+	{
+		btITaskScheduler* scheduler = sim_task_scheduler();
+		if (n_threads > scheduler->getMaxNumThreads()) {
+			n_threads = scheduler->getMaxNumThreads();
+		}
+		// XXX the scheduler is global, so this also applies to every
+		// other multithreaded sim
+		scheduler->setNumThreads(n_threads);
+
+		dispatcher = new btCollisionDispatcherMt(collisionConfiguration, 40);
+
+		// islands are solved in parallel, one pooled solver per thread;
+		// the Mt solver is only used for the one big island case. the
+		// pool deletes its solvers, but they're made here for the seeds
+		pool_solvers.resize(n_threads);
+		for (int i = 0; i < n_threads; i++) pool_solvers[i] = new btSequentialImpulseConstraintSolver();
+		btConstraintSolverPoolMt* pool = new btConstraintSolverPoolMt(&pool_solvers[0], n_threads);
+		solverPool = pool;
+		constraintSolver = new btSequentialImpulseConstraintSolverMt();
+
+		world = new btDiscreteDynamicsWorldMt(
+			dispatcher,
+			overlappingPairCache,
+			pool,
+			constraintSolver,
+			collisionConfiguration
+		);
+
+		world->setGravity(btVector3(0,-10,0));
+	}
+	#endif
+
+	struct sim_vehicle* get_vehicle(int i)
+	{
+		ASSERT(i >= 0 && i < vehicles.size());
+		return vehicles[i];
+	}
 
-struct sim_vehicle {
-	btRaycastVehicle::btVehicleTuning tuning;
-	btVehicleRaycaster* vehicleRayraster;
-	btRaycastVehicle* raycastVehicle;
-	btRigidBody* chassis;
-	btVector3 chassis_extents;
+	int add_vehicle(const btVector3& position, float yaw, int lite)
+	{
+		ASSERT(thread == NULL);
+
+		btTransform tx;
+		tx.setIdentity();
+		tx.setOrigin(position);
+		tx.setRotation(btQuaternion(yaw,0,0));
+
+		struct sim_vehicle* v = new struct sim_vehicle;
+		v->sim = this;
+		v->index = vehicles.size();
+		v->far = 0;
+		{
+			struct sim_arena_scope scope(&arena);
+			if (lite) {
+				if (fleet.n == 0) world->addAction(&fleet);
+				v->initialize_lite(world, tx, &fleet);
+			} else {
+				v->initialize(world, tx);
+			}
+		}
+		v->chassis->setContactProcessingThreshold(sim_quality_tiers[quality].contact_processing_threshold);
+		vehicles.push_back(v);
+
+		// prev starts out as cur, so the first frames don't lerp from nothing
+		struct sim_vehicle_state state;
+		v->capture_state(&state);
+		state_cur.push_back(state);
+		state_prev.push_back(state_cur[v->index]);
+		struct sim_vehicle_pose pose;
+		memset(&pose, 0, sizeof(struct sim_vehicle_pose));
+		frame_poses.push_back(pose);
+		frame_transforms.resize(vehicles.size() * SIM_POSE_MATRICES);
+
+		publish_poses();
+		latch_poses();
+
+		return v->index;
+	}
 
-	btRigidBody* make_chassis(btDynamicsWorld* world)
+	void initialize(int n_threads)
 	{
-		chassis_extents = btVector3(0.3, 0.1, 1);
-		btCollisionShape* shape = new btBoxShape(chassis_extents);
+		sim_install_allocator();
 
-		float mass = 600;
-		btVector3 local_inertia(0,0,0);
-		shape->calculateLocalInertia(mass, local_inertia);
+		this->n_threads = n_threads;
+		own_track_mesh = 0;
+		stream_radius = 0;
+		lod_path.set(NULL, 0, 0);
+
+		fixed_dt = 1.0f / (float)SIM_HZ;
+		step_budget = SIM_STEP_BUDGET;
+		quality = SIM_QUALITY_MEDIUM;
+		quality_auto = 0;
+
+		thread = NULL;
+		thread_running.store(0);
+		ctrl_queue.reset();
+		query_workers_started = 0;
+		arena.initialize();
+
+		start();
+	}
+
+	// the per-run part of initialize(); settings are left alone
+	void start()
+	{
+		track_mesh = NULL;
+		track_body = NULL;
+		n_blocks = 0;
+		retire_cursor = 0;
+		origin.setZero();
+		frame_origin.setZero();
+		lod_focus.setZero();
+		lod_direction.setZero();
+		lod_focus_set = 0;
+		n_far = 0;
+		track_build_time = 0;
+		step_time = 0;
+		step_count = 0;
+
+		accumulator = 0;
+		step_cost = 0;
+		time_dropped = 0;
+		time_scale = 1;
+		quality_timer = 0;
+		quality_time_dropped = 0;
+
+		poses.reset();
+		frame_transforms.reset();
+
+		{
+			struct sim_arena_scope scope(&arena);
+			_initialize_world();
+			fleet.initialize(this);
+			add_ground();
+		}
+		set_quality(quality);
+
+		add_vehicle(btVector3(10,20,10), -1.5, 0); // XXX see track_init_demo()
+	}
+
+	/* deletes every Bullet object but the track mesh, then the arena.
+	 * the objects still go one by one, since whatever they grew while
+	 * stepping came from the heap */
+	void teardown()
+	{
+		ASSERT(thread == NULL);
+		if (query_workers_started) {
+			query_workers.stop();
+			query_workers_started = 0;
+		}
+
+		for (int i = 0; i < vehicles.size(); i++) {
+			struct sim_vehicle* v = vehicles[i];
+			if (v->raycastVehicle != NULL) {
+				if (!v->far) world->removeVehicle(v->raycastVehicle);
+				delete v->raycastVehicle;
+				delete v->vehicleRayraster;
+			}
+			if (!v->far) world->removeRigidBody(v->chassis);
+			delete v->chassis->getMotionState();
+			if (v->fleet == NULL) delete v->chassis->getCollisionShape();
+			delete v->chassis;
+			delete v;
+		}
+		vehicles.clear();
+		if (fleet.n > 0) world->removeAction(&fleet);
+		delete fleet.shape;
+		fleet.clear();
+
+		while (active_chunks.size() > 0) retire_chunk(active_chunks.size() - 1);
+		chunk_bodies.clear();
+		if (track_body != NULL) {
+			if (stream_radius > 0) {
+				delete track_body->getCollisionShape(); // the stand-in
+			} else {
+				world->removeRigidBody(track_body); // the shape is the mesh's
+			}
+			delete track_body->getMotionState();
+			delete track_body;
+			track_body = NULL;
+		}
+
+		// the ground and blocks
+		btCollisionObjectArray& objects = world->getCollisionObjectArray();
+		while (objects.size() > 0) {
+			btCollisionObject* object = objects[objects.size() - 1];
+			btRigidBody* body = btRigidBody::upcast(object);
+			if (body != NULL) {
+				world->removeRigidBody(body);
+				delete body->getMotionState();
+			} else {
+				world->removeCollisionObject(object);
+			}
+			delete object->getCollisionShape();
+			delete object;
+		}
+
+		delete world;
+		delete constraintSolver;
+		delete solverPool;
+		pool_solvers.clear();
+		delete overlappingPairCache;
+		delete dispatcher;
+		delete collisionConfiguration;
+
+		state_prev.clear();
+		state_cur.clear();
+		frame_poses.clear();
+		ray_targets.clear();
+		arena.release();
+	}
+
+	/* a fresh world as sim_new() made it, on the same track mesh and
+	 * settings. no BVH is rebuilt, so it's about as cheap as a step */
+	void reset()
+	{
+		struct sim_track_mesh* mesh = track_mesh;
+		float dt = fixed_dt;
+		teardown();
+		start();
+		fixed_dt = dt;
+		if (mesh != NULL) set_track_mesh(mesh);
+	}
+
+	void destroy()
+	{
+		struct sim_track_mesh* mesh = track_mesh;
+		teardown();
+		if (own_track_mesh && mesh != NULL) {
+			mesh->release();
+			delete mesh;
+		}
+	}
+
+	void set_step_rate(int hz)
+	{
+		ASSERT(thread == NULL);
+		ASSERT(hz > 0);
+		fixed_dt = 1.0f / (float)hz;
+	}
+
+	void step_fixed()
+	{
+		btClock clock;
+		rebase();
+		update_lod(fixed_dt);
+		stream_track(SIM_STREAM_ACTIVATE_PER_STEP, SIM_STREAM_RETIRE_PER_STEP);
+		world->stepSimulation(fixed_dt, 1, fixed_dt);
+		double t = (double)clock.getTimeMicroseconds() * 1e-6;
+		step_time += t;
+		step_count++;
+		step_cost = step_cost > 0 ? step_cost * 0.9 + t * 0.1 : t;
+
+		for (int i = 0; i < vehicles.size(); i++) {
+			state_prev[i] = state_cur[i];
+			vehicles[i]->capture_state(&state_cur[i]);
+		}
+	}
+
+	void publish_poses()
+	{
+		ASSERT(state_prev.size() == state_cur.size());
+		struct sim_poses* slot = poses.write_slot();
+		slot->prev.copyFromArray(state_prev);
+		slot->cur.copyFromArray(state_cur);
+		slot->time = sim_clock();
+		slot->origin = origin;
+		poses.publish();
+	}
+
+	void interpolate_poses(float alpha)
+	{
+		if (alpha < 0) alpha = 0;
+		if (alpha > 1) alpha = 1;
+		struct sim_poses* slot = poses.read_slot();
+		int n = frame_poses.size();
+		ASSERT(slot->cur.size() == n);
+		frame_origin = slot->origin;
+		for (int i = 0; i < n; i++) {
+			struct sim_vehicle_pose* pose = &frame_poses[i];
+			vehicle_pose_lerp(pose, &frame_transforms, i, n, &slot->prev[i], &slot->cur[i], alpha);
+			vec3_from_btVector3(&pose->chassis_extents, vehicles[i]->chassis_extents);
+			pose->wheel_radius = WHEEL_RADIUS;
+		}
+	}
+
+	void latch_poses()
+	{
+		poses.latch();
+		if (thread != NULL) {
+			// rendering one step behind the physics thread
+			struct sim_poses* slot = poses.read_slot();
+			interpolate_poses((float)((sim_clock() - slot->time) / (double)fixed_dt));
+		} else {
+			interpolate_poses((float)(accumulator / (double)fixed_dt));
+		}
+	}
+
+	void set_quality(int q)
+	{
+		ASSERT(thread == NULL);
+		ASSERT(q >= 0 && q < SIM_QUALITY_COUNT);
+		const struct sim_quality_tier* tier = &sim_quality_tiers[q];
+		quality = q;
+
+		set_step_rate(tier->hz);
+
+		btContactSolverInfo& info = world->getSolverInfo();
+		info.m_numIterations = tier->solver_iterations;
+		info.m_splitImpulse = tier->split_impulse;
+
+		for (int i = 0; i < vehicles.size(); i++) {
+			vehicles[i]->chassis->setContactProcessingThreshold(tier->contact_processing_threshold);
+		}
+
+		// costs of the old tier say nothing about the new one
+		step_cost = 0;
+	}
+
+	/* every SIM_QUALITY_INTERVAL, goes one tier down if physics takes too
+	 * big a share of real time or had to drop time, or one up if the
+	 * next tier would still be cheap by a rough estimate (steps scale
+	 * with the rate, solving with the iterations) */
+	void update_quality_auto(double dt)
+	{
+		if (!quality_auto) return;
+		quality_timer += dt;
+		if (quality_timer < SIM_QUALITY_INTERVAL || step_cost <= 0) return;
+		quality_timer = 0;
+
+		const struct sim_quality_tier* tier = &sim_quality_tiers[quality];
+		double load = step_cost * (double)tier->hz;
+		bool dropped = time_dropped > quality_time_dropped;
+		quality_time_dropped = time_dropped;
+
+		if ((load > SIM_QUALITY_LOAD_HIGH || dropped) && quality > 0) {
+			set_quality(quality - 1);
+		} else if (quality + 1 < SIM_QUALITY_COUNT) {
+			const struct sim_quality_tier* next = &sim_quality_tiers[quality + 1];
+			double estimate = load * (double)next->hz / (double)tier->hz;
+			if (next->solver_iterations > tier->solver_iterations) {
+				estimate *= (double)next->solver_iterations / (double)tier->solver_iterations;
+			}
+			if (estimate < SIM_QUALITY_LOAD_LOW) set_quality(quality + 1);
+		}
+	}
+
+	// how many steps fit the budget, going by what steps cost lately
+	int budget_steps()
+	{
+		if (step_budget <= 0 || step_cost <= 0) return SIM_MAX_STEPS_PER_CALL;
+		double n = step_budget / step_cost;
+		if (n < 1) return 1;
+		if (n > SIM_MAX_STEPS_PER_CALL) return SIM_MAX_STEPS_PER_CALL;
+		return (int)n;
+	}
+
+	/* when stepping can't keep up (a hitch, or just a slow machine),
+	 * running every step that's due makes this frame slow too, which
+	 * makes the next one owe even more steps. instead at most
+	 * budget_steps() are run, and also no more once the budget has been
+	 * spent; of the rest, SIM_MAX_BACKLOG_STEPS are kept to catch up on
+	 * over the next frames, and anything beyond is dropped, so game time
+	 * runs slower than real time until the load goes away */
+	int step(double dt, int limit)
+	{
+		ASSERT(thread == NULL);
+
+		int max_steps = budget_steps();
+		int n = 0;
+		double t0 = sim_clock();
+		accumulator += dt;
+		while (accumulator >= fixed_dt) {
+			if (n == limit) break; // the rest is for the next call
+			bool over_budget = n > 0 && step_budget > 0 && sim_clock() - t0 >= step_budget;
+			if (n == max_steps || over_budget) {
+				double max_backlog = (double)fixed_dt * SIM_MAX_BACKLOG_STEPS;
+				if (accumulator > max_backlog) {
+					time_dropped += accumulator - max_backlog;
+					accumulator = max_backlog;
+				}
+				break;
+			}
+			step_fixed();
+			accumulator -= fixed_dt;
+			n++;
+		}
+
+		if (dt > 0) {
+			double scale = (double)n * (double)fixed_dt / dt;
+			time_scale = time_scale * 0.95 + scale * 0.05;
+		}
+
+		if (n > 0) publish_poses();
+		latch_poses();
+
+		update_quality_auto(dt);
+
+		return n;
+	}
+
+	double get_lag()
+	{
+		// less than a step is just interpolation
+		return accumulator >= fixed_dt ? accumulator : 0;
+	}
+
+	void thread_main()
+	{
+		typedef std::chrono::steady_clock clock;
+		clock::duration period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(fixed_dt));
+		clock::time_point next = clock::now();
+		while (thread_running.load(std::memory_order_acquire)) {
+			drain_ctrl_queue();
+
+			step_fixed();
+			publish_poses();
+
+			next += period;
+			clock::time_point now = clock::now();
+			if (now > next + period * 8) {
+				// way behind (debugger, suspend); don't try to catch up
+				next = now;
+			}
+			std::this_thread::sleep_until(next);
+		}
+	}
+
+	void thread_start()
+	{
+		ASSERT(thread == NULL);
+		thread_running.store(1);
+		thread = new std::thread(&sim::thread_main, this);
+	}
+
+	void thread_stop()
+	{
+		ASSERT(thread != NULL);
+		thread_running.store(0, std::memory_order_release);
+		thread->join();
+		delete thread;
+		thread = NULL;
+
+		drain_ctrl_queue();
+		accumulator = 0;
+		latch_poses();
+	}
+
+	void drain_ctrl_queue()
+	{
+		struct sim_ctrl_msg msg;
+		while (ctrl_queue.pop(&msg)) {
+			vehicles[msg.vehicle]->ctrl(&msg.ctrl);
+		}
+	}
+
+	void apply_controls(const struct sim_ctrl* ctrls, int n)
+	{
+		ASSERT(n >= 0 && n <= vehicles.size());
+		if (thread != NULL) {
+			for (int i = 0; i < n; i++) {
+				struct sim_ctrl_msg msg;
+				msg.vehicle = i;
+				msg.ctrl = ctrls[i];
+				if (!ctrl_queue.push(&msg)) {
+					// physics thread stalled; drop the rest, the
+					// next frame sends the same state anyway
+					break;
+				}
+			}
+		} else {
+			for (int i = 0; i < n; i++) vehicles[i]->ctrl(&ctrls[i]);
+		}
+	}
+
+	void vehicle_ctrl(struct sim_vehicle* v, const struct sim_ctrl* c)
+	{
+		if (thread != NULL) {
+			struct sim_ctrl_msg msg;
+			msg.vehicle = v->index;
+			msg.ctrl = *c;
+			ctrl_queue.push(&msg);
+		} else {
+			v->ctrl(c);
+		}
+	}
+
+	void get_poses(struct mat44* out, int n)
+	{
+		ASSERT(n >= 0 && n <= frame_poses.size());
+		int n_vehicles = frame_poses.size();
+		for (int i = 0; i < n; i++) {
+			struct mat44* dst = &out[i * SIM_POSE_MATRICES];
+			frame_transforms.get(i, &dst[0]);
+			for (int w = 0; w < 4; w++) frame_transforms.get(n_vehicles + i*4 + w, &dst[1+w]);
+		}
+	}
+
+	void get_vehicle_pose(int i, struct sim_vehicle_pose* pose)
+	{
+		int n_vehicles = frame_poses.size();
+		memcpy(pose, &frame_poses[i], sizeof(struct sim_vehicle_pose));
+		frame_transforms.get(i, &pose->chassis);
+		for (int w = 0; w < 4; w++) frame_transforms.get(n_vehicles + i*4 + w, &pose->wheels[w]);
+	}
+
+	void set_track_mesh(struct sim_track_mesh* mesh)
+	{
+		ASSERT(track_body == NULL);
+
+		btClock clock;
+
+		track_mesh = mesh;
 
 		btTransform tx;
 		tx.setIdentity();
-		tx.setOrigin(btVector3(10,20,10)); // XXX see track_init_demo()
-		tx.setRotation(btQuaternion(-1.5,0,0));
+
+		tx.setOrigin(mesh->anchor() - origin);
+		struct sim_arena_scope scope(&arena);
 		btDefaultMotionState* mstate = new btDefaultMotionState(tx);
-		btRigidBody::btRigidBodyConstructionInfo cinfo(mass, mstate, shape, local_inertia);
+		if (stream_radius > 0) {
+			/* the wheels still want a static body to push against for
+			 * a grid hit (see sim_vehicle_raycaster), whether or not
+			 * the chunk there is in the world */
+			btRigidBody::btRigidBodyConstructionInfo cinfo(0, mstate, new btEmptyShape);
+			track_body = new btRigidBody(cinfo);
+			struct sim_track_chunk_body empty = {NULL, NULL, NULL};
+			struct sim_arena_scope heap(NULL); // chunks are retired as they go
+			chunk_bodies.resize(mesh->chunks.size(), empty);
+			stream_track(mesh->chunks.size(), 0);
+		} else {
+			btRigidBody::btRigidBodyConstructionInfo cinfo(0, mstate, mesh->get_shape());
+			track_body = new btRigidBody(cinfo);
+			track_body->setContactProcessingThreshold(1e3); // ???
+			world->addRigidBody(track_body);
+		}
+
+		track_build_time += (double)clock.getTimeMicroseconds() * 1e-6;
+	}
+
+	bool is_track(const btCollisionObject* object)
+	{
+		return object == track_body || (track_mesh != NULL && object->getUserPointer() == track_mesh);
+	}
+
+	void activate_chunk(int c)
+	{
+		struct sim_track_chunk* chunk = &track_mesh->chunks[c];
+		struct sim_track_chunk_body* cb = &chunk_bodies[c];
+		ASSERT(cb->body == NULL);
+		cb->mesh = track_mesh->chunk_mesh(c);
+		cb->shape = new btBvhTriangleMeshShape(cb->mesh, true);
+		btRigidBody::btRigidBodyConstructionInfo cinfo(0, NULL, cb->shape);
+		cinfo.m_startWorldTransform.setOrigin(chunk->anchor - origin);
+		cb->body = new btRigidBody(cinfo);
+		cb->body->setContactProcessingThreshold(1e3); // like the whole track body
+		cb->body->setUserPointer(track_mesh); // see is_track()
+		world->addRigidBody(cb->body);
+		active_chunks.push_back(c);
+	}
+
+	// by index into active_chunks, which gets the last one moved in
+	void retire_chunk(int slot)
+	{
+		struct sim_track_chunk_body* cb = &chunk_bodies[active_chunks[slot]];
+		world->removeRigidBody(cb->body);
+		delete cb->body;
+		delete cb->shape;
+		delete cb->mesh;
+		cb->body = NULL;
+		cb->shape = NULL;
+		cb->mesh = NULL;
+		active_chunks[slot] = active_chunks[active_chunks.size() - 1];
+		active_chunks.pop_back();
+	}
+
+	// squared XZ distance from world point p to a chunk
+	btScalar chunk_point_distance2(int c, const btVector3& p)
+	{
+		struct sim_track_chunk* chunk = &track_mesh->chunks[c];
+		btScalar dx = btMax(btMax(chunk->aabb_min[0] - p[0], p[0] - chunk->aabb_max[0]), btScalar(0));
+		btScalar dz = btMax(btMax(chunk->aabb_min[2] - p[2], p[2] - chunk->aabb_max[2]), btScalar(0));
+		return dx*dx + dz*dz;
+	}
+
+	/* from the nearest vehicle; loops over all of them, so it's only for
+	 * the few chunks the retire check looks at per step */
+	btScalar chunk_distance2(int c)
+	{
+		btScalar best = BT_LARGE_FLOAT;
+		for (int i = 0; i < vehicles.size(); i++) {
+			if (vehicles[i]->far) continue; // they don't touch the track
+			btVector3 p = vehicles[i]->chassis->getWorldTransform().getOrigin() + origin;
+			best = btMin(best, chunk_point_distance2(c, p));
+		}
+		return best;
+	}
+
+	/* activates chunks within stream_radius of a vehicle, nearest tiles
+	 * first, and retires chunks that have fallen well behind. the tiles
+	 * under and next to each vehicle are always activated right away; the
+	 * rest is spread over steps so no single step pays for many BVHs */
+	void stream_track(int activate_budget, int retire_budget)
+	{
+		if (stream_radius <= 0 || track_mesh == NULL) return;
+		struct sim_track_mesh* tm = track_mesh;
+
+		btScalar r2 = stream_radius * stream_radius;
+		int rings = (int)(stream_radius / SIM_TRACK_CHUNK_SIZE) + 1;
+		for (int i = 0; i < vehicles.size(); i++) {
+			if (vehicles[i]->far) continue;
+			btVector3 p = vehicles[i]->chassis->getWorldTransform().getOrigin() + origin;
+			int cx = (int)floor((p[0] - tm->chunk_min_x) / SIM_TRACK_CHUNK_SIZE);
+			int cz = (int)floor((p[2] - tm->chunk_min_z) / SIM_TRACK_CHUNK_SIZE);
+			for (int r = 0; r <= rings; r++) {
+				for (int dz = -r; dz <= r; dz++) {
+					for (int dx = -r; dx <= r; dx++) {
+						if (btMax(abs(dx), abs(dz)) != r) continue; // ring only
+						int x = cx + dx;
+						int z = cz + dz;
+						if (x < 0 || x >= tm->chunk_nx || z < 0 || z >= tm->chunk_nz) continue;
+						int c = z * tm->chunk_nx + x;
+						if (tm->chunks[c].count == 0 || chunk_bodies[c].body != NULL) continue;
+						if (r > 1 && activate_budget <= 0) continue;
+						if (chunk_point_distance2(c, p) > r2) continue;
+						activate_chunk(c);
+						if (r > 1) activate_budget--;
+					}
+				}
+			}
+		}
+
+		btScalar retire_r2 = r2 * SIM_STREAM_HYSTERESIS * SIM_STREAM_HYSTERESIS;
+		for (int k = 0; k < SIM_STREAM_CHECKS_PER_STEP && retire_budget > 0 && active_chunks.size() > 0; k++) {
+			if (retire_cursor >= active_chunks.size()) retire_cursor = 0;
+			if (chunk_distance2(active_chunks[retire_cursor]) > retire_r2) {
+				retire_chunk(retire_cursor);
+				retire_budget--;
+			} else {
+				retire_cursor++;
+			}
+		}
+	}
+
+	static btScalar rebase_snap(btScalar x)
+	{
+		return (btScalar)floor(x / SIM_REBASE_SNAP + 0.5) * SIM_REBASE_SNAP;
+	}
+
+	/* floating origin; keeps vehicle 0 near zero so the broadphase
+	 * quantization and float precision stay as good as at the start,
+	 * however far the track goes. XZ only; the ground box isn't moved,
+	 * so it stays under the origin */
+	void rebase()
+	{
+		const btVector3& p = vehicles[0]->chassis->getWorldTransform().getOrigin();
+		if (btFabs(p[0]) < SIM_REBASE_DISTANCE && btFabs(p[2]) < SIM_REBASE_DISTANCE) return;
+		shift_origin(btVector3(rebase_snap(p[0]), 0, rebase_snap(p[2])));
+	}
+
+	// everything but the ground moves by -delta, in one pass
+	void shift_origin(const btVector3& delta)
+	{
+		if (delta.isZero()) return;
+		origin += delta;
+
+		btCollisionObjectArray& objects = world->getCollisionObjectArray();
+		for (int i = 0; i < objects.size(); i++) {
+			btCollisionObject* object = objects[i];
+			if (object == ground_body) continue;
+			object->getWorldTransform().getOrigin() -= delta;
+			object->getInterpolationWorldTransform().getOrigin() -= delta;
+			btRigidBody* body = btRigidBody::upcast(object);
+			if (body != NULL && body->getMotionState() != NULL) {
+				btTransform tx;
+				body->getMotionState()->getWorldTransform(tx);
+				tx.getOrigin() -= delta;
+				body->getMotionState()->setWorldTransform(tx);
+			}
+			world->updateSingleAabb(object);
+		}
+		if (stream_radius > 0 && track_body != NULL) {
+			// the stand-in isn't in the world
+			track_body->getWorldTransform().getOrigin() -= delta;
+		}
+
+		int n_manifolds = dispatcher->getNumManifolds();
+		for (int i = 0; i < n_manifolds; i++) {
+			btPersistentManifold* m = dispatcher->getManifoldByIndexInternal(i);
+			for (int j = 0; j < m->getNumContacts(); j++) {
+				btManifoldPoint& pt = m->getContactPoint(j);
+				pt.m_positionWorldOnA -= delta;
+				pt.m_positionWorldOnB -= delta;
+			}
+		}
+
+		for (int i = 0; i < vehicles.size(); i++) {
+			if (vehicles[i]->far) {
+				// not in the world
+				btTransform tx = vehicles[i]->chassis->getWorldTransform();
+				tx.getOrigin() -= delta;
+				sim_place_body(vehicles[i]->chassis, tx);
+			}
+			// lite wheels redo their contacts from scratch every step
+			btRaycastVehicle* rv = vehicles[i]->raycastVehicle;
+			for (int w = 0; rv != NULL && w < rv->getNumWheels(); w++) {
+				btWheelInfo& wheel = rv->getWheelInfo(w);
+				wheel.m_worldTransform.getOrigin() -= delta;
+				wheel.m_raycastInfo.m_contactPointWS -= delta;
+				wheel.m_raycastInfo.m_hardPointWS -= delta;
+			}
+			struct sim_vehicle_state* states[2] = {&state_prev[i], &state_cur[i]};
+			for (int k = 0; k < 2; k++) {
+				states[k]->chassis.getOrigin() -= delta;
+				for (int w = 0; w < 4; w++) {
+					states[k]->wheels[w].getOrigin() -= delta;
+					states[k]->wheel_hardpoints[w] -= delta;
+				}
+			}
+		}
+	}
+
+	void set_lod_path(const struct vec3* points, int n, int closed)
+	{
+		ASSERT(thread == NULL);
+		ASSERT(n_far == 0);
+		lod_path.set(points, n, closed);
+	}
+
+	// reader side; position and direction in the current frame's coordinates
+	void set_lod_focus(const btVector3& position, const btVector3& direction)
+	{
+		std::lock_guard<std::mutex> lock(lod_mutex);
+		lod_focus = position + frame_origin;
+		lod_direction = direction;
+		lod_focus_set = 1;
+	}
+
+	// height of the track or ground under a world position, if close
+	bool probe_ground(const btVector3& p, btScalar* y)
+	{
+		btVector3 from = p + btVector3(0, SIM_LOD_PROBE, 0);
+		btVector3 to = p - btVector3(0, SIM_LOD_PROBE, 0);
+		btScalar fraction = 1;
+		btScalar f;
+		btVector3 n;
+		if (track_mesh != NULL && track_mesh->grid.raycast(from, to, btVector3(0,0,0), &f, &n)) fraction = f;
+		btScalar h = ground_height; // the ground doesn't move with the origin, but Y never does
+		if (from[1] >= h && to[1] < h) fraction = btMin(fraction, (from[1] - h) / (from[1] - to[1]));
+		if (fraction >= 1) return false;
+		*y = from[1] + (to[1] - from[1]) * fraction;
+		return true;
+	}
+
+	/* the vehicle leaves the world, keeping where it is relative to the
+	 * path (arc length, lateral offset, height above the ground, rotation
+	 * against the path frame) and how it moves in the path frame; only the
+	 * speed along the path is used while far, the rest comes back in
+	 * lod_near() */
+	void lod_far(struct sim_vehicle* v)
+	{
+		btRigidBody* body = v->chassis;
+		const btTransform& tx = body->getWorldTransform();
+		btVector3 p = tx.getOrigin() + origin;
+		v->lod_s = lod_path.project(p);
+		btVector3 c;
+		btMatrix3x3 basis;
+		lod_path.frame(v->lod_s, &c, &basis);
+		v->lod_lateral = (p - c).dot(basis.getColumn(0));
+		btScalar ground;
+		if (!probe_ground(p, &ground)) ground = c[1];
+		v->lod_clearance = p[1] - ground;
+		btMatrix3x3 to_path = basis.transpose();
+		v->lod_velocity = to_path * body->getLinearVelocity();
+		v->lod_angular = to_path * body->getAngularVelocity();
+		v->lod_speed = v->lod_velocity[2];
+		(basis.transpose() * tx.getBasis()).getRotation(v->lod_offset);
+
+		if (v->fleet != NULL) {
+			v->fleet->enabled[v->fleet_index] = 0;
+		} else {
+			world->removeVehicle(v->raycastVehicle);
+		}
+		world->removeRigidBody(body);
+		v->far = 1;
+		n_far++;
+	}
+
+	/* back in the world where the path left it, moving as it did when it
+	 * left, relative to the path frame here; the wheels keep their
+	 * suspension and spin, so nothing jumps. XXX two far vehicles can come
+	 * back overlapping */
+	void lod_near(struct sim_vehicle* v)
+	{
+		btVector3 c;
+		btMatrix3x3 basis;
+		lod_path.frame(v->lod_s, &c, &basis);
+		v->lod_velocity[2] = v->lod_speed;
+		btVector3 velocity = basis * v->lod_velocity;
+		btVector3 angular = basis * v->lod_angular;
+		btRigidBody* body = v->chassis;
+		body->setLinearVelocity(velocity);
+		body->setAngularVelocity(angular);
+		body->setInterpolationLinearVelocity(velocity);
+		body->setInterpolationAngularVelocity(angular);
+
+		world->addRigidBody(body);
+		if (v->fleet != NULL) {
+			v->fleet->enabled[v->fleet_index] = 1;
+		} else {
+			world->addVehicle(v->raycastVehicle);
+		}
+		v->far = 0;
+		n_far--;
+	}
+
+	/* a far vehicle is only a point on the path: it moves along at the
+	 * speed it had, and turns toward the road's heading (or against it,
+	 * when going backwards). one ground probe
+	 * instead of four wheel rays, and no collision or solving at all. XXX
+	 * controls are ignored meanwhile */
+	void lod_follow(struct sim_vehicle* v, btScalar dt)
+	{
+		v->lod_s += v->lod_speed * dt;
+		if (!lod_path.closed && (v->lod_s <= 0 || v->lod_s >= lod_path.length)) {
+			// ran off an open path's end; it stops there
+			v->lod_speed = 0;
+			v->lod_velocity.setZero();
+			v->lod_angular.setZero();
+		}
+		v->lod_s = lod_path.wrap(v->lod_s);
+		// facing the way it goes: down the path, or back up it
+		btScalar settle = btMin(btScalar(SIM_LOD_SETTLE) * dt, btScalar(1));
+		btQuaternion heading = v->lod_speed < 0 ? btQuaternion(btVector3(0,1,0), SIMD_PI) : btQuaternion::getIdentity();
+		v->lod_offset = v->lod_offset.slerp(heading, settle);
+
+		btVector3 c;
+		btMatrix3x3 basis;
+		lod_path.frame(v->lod_s, &c, &basis);
+		btVector3 p = c + basis.getColumn(0) * v->lod_lateral;
+		btScalar ground;
+		if (!probe_ground(p, &ground)) ground = c[1];
+		p[1] = ground + v->lod_clearance;
+
+		btRigidBody* body = v->chassis;
+		sim_place_body(body, btTransform(basis * btMatrix3x3(v->lod_offset), p - origin));
+		btVector3 velocity = basis.getColumn(2) * v->lod_speed;
+		body->setLinearVelocity(velocity);
+		body->setAngularVelocity(btVector3(0,0,0));
+		body->setInterpolationLinearVelocity(velocity);
+		body->setInterpolationAngularVelocity(btVector3(0,0,0));
+		v->spin_wheels(v->lod_speed, dt);
+	}
+
+	/* physics LOD; vehicle 0 is always simulated in full. without a focus
+	 * from sim_set_lod_focus() the distances are from vehicle 0 */
+	void update_lod(btScalar dt)
+	{
+		if (!lod_path.valid()) return;
+
+		btVector3 focus;
+		btVector3 direction;
+		{
+			std::lock_guard<std::mutex> lock(lod_mutex);
+			focus = lod_focus;
+			direction = lod_direction;
+			if (!lod_focus_set) {
+				focus = vehicles[0]->chassis->getWorldTransform().getOrigin() + origin;
+				direction.setZero();
+			}
+		}
+
+		btScalar far2 = SIM_LOD_FAR * SIM_LOD_FAR;
+		btScalar near2 = SIM_LOD_NEAR * SIM_LOD_NEAR;
+		for (int i = 1; i < vehicles.size(); i++) {
+			struct sim_vehicle* v = vehicles[i];
+			btVector3 d = v->chassis->getWorldTransform().getOrigin() + origin - focus;
+			btScalar d2 = d.length2();
+			if (d.dot(direction) < 0) d2 *= SIM_LOD_BEHIND * SIM_LOD_BEHIND;
+			if (!v->far && d2 > far2) {
+				lod_far(v);
+			} else if (v->far && d2 < near2) {
+				lod_near(v);
+			}
+			if (v->far) lod_follow(v, dt);
+		}
+	}
+
+	void set_track_streaming(btScalar radius)
+	{
+		ASSERT(track_mesh == NULL);
+		ASSERT(radius >= 0);
+		stream_radius = radius;
+	}
+
+	void add_block(struct vec3* points, int n_points)
+	{
+		btClock clock;
+		struct sim_arena_scope scope(&arena);
+
+		btConvexHullShape* shape = new btConvexHullShape;
+		for (int i = 0; i < n_points; i++) {
+			struct vec3* p = &points[i];
+			btVector3 btp(p->s[0], p->s[1], p->s[2]);
+			shape->addPoint(btp);
+		}
+
+		btTransform tx;
+		tx.setIdentity();
+		tx.setOrigin(-origin);
+
+		btDefaultMotionState* mstate = new btDefaultMotionState(tx);
+		btRigidBody::btRigidBodyConstructionInfo cinfo(0, mstate, shape);
 		btRigidBody* body = new btRigidBody(cinfo);
-		body->setContactProcessingThreshold(1e6); // ???
+		body->setContactProcessingThreshold(1e3); // ???
 		world->addRigidBody(body);
-		body->setActivationState(DISABLE_DEACTIVATION);
-		return body;
+		n_blocks++;
+
+		track_build_time += (double)clock.getTimeMicroseconds() * 1e-6;
+	}
+
+	// everything but the track and the ground, which have their own paths
+	void collect_ray_targets()
+	{
+		btCollisionObjectArray& objects = world->getCollisionObjectArray();
+		ray_targets.resize(0);
+		for (int i = 0; i < objects.size(); i++) {
+			btCollisionObject* object = objects[i];
+			if (is_track(object) || object == ground_body) continue;
+			struct sim_ray_target target;
+			target.object = object;
+			object->getCollisionShape()->getAabb(object->getWorldTransform(), target.bounds[0], target.bounds[1]);
+			struct sim_vehicle* v = (struct sim_vehicle*)object->getUserPointer();
+			target.vehicle = v != NULL ? v->index : -1;
+			ray_targets.push_back(target);
+		}
+	}
+
+	void raycast(const struct sim_ray* ray, struct sim_ray_hit* hit) const
+	{
+		btVector3 from(ray->from.s[0], ray->from.s[1], ray->from.s[2]);
+		btVector3 to(ray->to.s[0], ray->to.s[1], ray->to.s[2]);
+		btVector3 dir = to - from;
+
+		btScalar fraction = 1;
+		btVector3 normal(0,1,0);
+		int vehicle = -1;
+		bool any = false;
+
+		btScalar f;
+		btVector3 n;
+		if (track_mesh != NULL && track_mesh->grid.raycast(from, to, origin, &f, &n)) {
+			fraction = f;
+			normal = n;
+			any = true;
+		}
+
+		// the ground box from either side
+		if ((from[1] - ground_height) * (to[1] - ground_height) < 0) {
+			f = (from[1] - ground_height) / (from[1] - to[1]);
+			if (f < fraction) {
+				fraction = f;
+				normal = btVector3(0, from[1] > ground_height ? 1 : -1, 0);
+				any = true;
+			}
+		}
+
+		btVector3 inv_dir(
+			dir[0] == 0 ? BT_LARGE_FLOAT : 1 / dir[0],
+			dir[1] == 0 ? BT_LARGE_FLOAT : 1 / dir[1],
+			dir[2] == 0 ? BT_LARGE_FLOAT : 1 / dir[2]);
+		unsigned sign[3] = {inv_dir[0] < 0, inv_dir[1] < 0, inv_dir[2] < 0};
+		btTransform from_tx, to_tx;
+		from_tx.setIdentity();
+		from_tx.setOrigin(from);
+		to_tx.setIdentity();
+		to_tx.setOrigin(to);
+		for (int i = 0; i < ray_targets.size(); i++) {
+			const struct sim_ray_target& target = ray_targets[i];
+			btScalar tmin;
+			if (!btRayAabb2(from, inv_dir, sign, target.bounds, tmin, 0, fraction)) continue;
+			btCollisionWorld::ClosestRayResultCallback cb(from, to);
+			cb.m_closestHitFraction = fraction;
+			btCollisionWorld::rayTestSingle(from_tx, to_tx, target.object, target.object->getCollisionShape(), target.object->getWorldTransform(), cb);
+			if (!cb.hasHit()) continue;
+			fraction = cb.m_closestHitFraction;
+			normal = cb.m_hitNormalWorld.normalized();
+			vehicle = target.vehicle;
+			any = true;
+		}
+
+		if (!any) {
+			hit->hit = 0;
+			return;
+		}
+		btVector3 p = from.lerp(to, fraction);
+		hit->hit = 1;
+		hit->fraction = fraction;
+		for (int k = 0; k < 3; k++) {
+			hit->position.s[k] = p[k];
+			hit->normal.s[k] = normal[k];
+		}
+		hit->vehicle = vehicle;
 	}
 
-	void initialize(btDynamicsWorld* world)
+	static void raycast_job(void* usr, int i)
 	{
-		chassis = make_chassis(world);
-		vehicleRayraster = new btDefaultVehicleRaycaster(world);
-		raycastVehicle = new btRaycastVehicle(tuning, chassis, vehicleRayraster);
-		world->addVehicle(raycastVehicle);
-		raycastVehicle->setCoordinateSystem(0,1,2);
-		btVector3 dir(0,-1,0);
-		btVector3 axle(-1,0,0);
-		float suspension_rest_length = 0.6;
-		for (int i = 0; i < 4; i++) {
-			bool is_front_wheel = i < 2;
-			float dside = 0.5;
-			float dx = i&1 ? dside : -dside;
-			float dfront = 1.6;
-			//float h = -0.1;
-			float h = 0.2;
-			float dz = is_front_wheel ? dfront : -dfront;
-			btVector3 point(dx, h, dz);
-			btWheelInfo& wheel = raycastVehicle->addWheel(point, dir, axle, suspension_rest_length, WHEEL_RADIUS, tuning, is_front_wheel);
-			wheel.m_suspensionStiffness = 10;
-			wheel.m_wheelsDampingRelaxation = 2.3;
-			wheel.m_wheelsDampingCompression = 4.4;
-			wheel.m_frictionSlip = 100;
-			wheel.m_rollInfluence = 0.1;
+		struct sim* sim = (struct sim*)usr;
+		int end = btMin((i + 1) * SIM_RAYCAST_CHUNK, sim->batch_n);
+		for (int j = i * SIM_RAYCAST_CHUNK; j < end; j++) {
+			sim->raycast(&sim->batch_rays[j], &sim->batch_hits[j]);
 		}
-		//raycastVehicle->getRigidBody()->applyImpulse(btVector3(-22,-2,-2), btVector3(10,0,0));
 	}
-};
 
-struct sim {
-	class btDynamicsWorld* world;
-	class btConstraintSolver* constraintSolver;
-	class btBroadphaseInterface* overlappingPairCache;
-	class btCollisionDispatcher* dispatcher;
-	class btCollisionConfiguration* collisionConfiguration;
+	void raycast_batch(const struct sim_ray* rays, struct sim_ray_hit* hits, int n)
+	{
+		ASSERT(thread == NULL);
+		ASSERT(n >= 0);
+		if (n == 0) return;
 
-	struct sim_vehicle vehicle;
+		collect_ray_targets();
+		batch_rays = rays;
+		batch_hits = hits;
+		batch_n = n;
 
-	void _initialize_world()
+		int n_jobs = (n + SIM_RAYCAST_CHUNK - 1) / SIM_RAYCAST_CHUNK;
+		if (n_jobs == 1) {
+			raycast_job(this, 0);
+			return;
+		}
+		if (!query_workers_started) {
+			int n_cores = std::thread::hardware_concurrency();
+			query_workers.start(n_cores > 0 ? n_cores : 1);
+			query_workers_started = 1;
+		}
+		query_workers.run(n_jobs, raycast_job, this);
+	}
+
+	int count_dynamic_bodies()
 	{
-		collisionConfiguration = new btDefaultCollisionConfiguration();
-		dispatcher = new btCollisionDispatcher(collisionConfiguration);
+		int n = 0;
+		btCollisionObjectArray& objects = world->getCollisionObjectArray();
+		for (int i = 0; i < objects.size(); i++) {
+			if (!objects[i]->isStaticOrKinematicObject()) n++;
+		}
+		return n;
+	}
 
-		btVector3 worldMin(-WORLD_MAX, -WORLD_MAX, -WORLD_MAX);
-		btVector3 worldMax(WORLD_MAX, WORLD_MAX, WORLD_MAX);
-		overlappingPairCache = new btAxisSweep3(worldMin, worldMax);
+	/* takes every body out of the world and puts them back in a fixed
+	 * order: the other static bodies as they are (they never leave, so
+	 * their order doesn't change), then the track chunks in active_chunks
+	 * order, then the chassis. with the broadphase pool reset in between,
+	 * the pairs and the manifolds come back in an order that depends on
+	 * nothing but that, and the AABBs, pairs and contacts are worked out
+	 * like at the start of a step. snapshot() and restore() both do this,
+	 * since Bullet's own order depends on the whole history */
+	void rebuild_broadphase()
+	{
+		btCollisionObjectArray& objects = world->getCollisionObjectArray();
+		rebuild_bodies.resize(0);
+		for (int i = 0; i < objects.size(); i++) {
+			btRigidBody* body = btRigidBody::upcast(objects[i]);
+			AN(body);
+			if (body->isStaticOrKinematicObject() && !is_track(body)) rebuild_bodies.push_back(body);
+		}
+		if (track_body != NULL && stream_radius <= 0) rebuild_bodies.push_back(track_body);
+		for (int i = 0; i < active_chunks.size(); i++) rebuild_bodies.push_back(chunk_bodies[active_chunks[i]].body);
+		for (int i = 0; i < vehicles.size(); i++) rebuild_bodies.push_back(vehicles[i]->chassis);
+		ASSERT(rebuild_bodies.size() == objects.size());
 
-		constraintSolver = new btSequentialImpulseConstraintSolver();
+		rebuild_filters.resize(rebuild_bodies.size() * 2);
+		for (int i = 0; i < rebuild_bodies.size(); i++) {
+			btBroadphaseProxy* proxy = rebuild_bodies[i]->getBroadphaseHandle();
+			rebuild_filters[i*2] = proxy->m_collisionFilterGroup;
+			rebuild_filters[i*2+1] = proxy->m_collisionFilterMask;
+			world->removeRigidBody(rebuild_bodies[i]);
+		}
+		ASSERT(dispatcher->getNumManifolds() == 0);
+		overlappingPairCache->resetPool(dispatcher);
+		for (int i = 0; i < rebuild_bodies.size(); i++) {
+			world->addRigidBody(rebuild_bodies[i], rebuild_filters[i*2], rebuild_filters[i*2+1]);
+		}
 
-		world = new btDiscreteDynamicsWorld(
-			dispatcher,
-			overlappingPairCache,
-			constraintSolver,
-			collisionConfiguration
+		world->updateAabbs();
+		// the plain dispatcher's; the Mt one makes manifolds in whatever
+		// order the threads get to the pairs
+		dispatcher->btCollisionDispatcher::dispatchAllCollisionPairs(
+			overlappingPairCache->getOverlappingPairCache(),
+			world->getDispatchInfo(),
+			dispatcher
 		);
+	}
 
-		world->setGravity(btVector3(0,-10,0));
+	// finds the manifold of a pair after rebuild_broadphase()
+	btPersistentManifold* find_manifold(const btCollisionObject* body0, const btCollisionObject* body1)
+	{
+		btBroadphasePair* pair = overlappingPairCache->getOverlappingPairCache()->findPair(
+			(btBroadphaseProxy*)body0->getBroadphaseHandle(),
+			(btBroadphaseProxy*)body1->getBroadphaseHandle());
+		if (pair == NULL || pair->m_algorithm == NULL) return NULL;
+		rebuild_manifolds.resize(0);
+		pair->m_algorithm->getAllContactManifolds(rebuild_manifolds);
+		for (int i = 0; i < rebuild_manifolds.size(); i++) {
+			btPersistentManifold* m = rebuild_manifolds[i];
+			if ((m->getBody0() == body0 && m->getBody1() == body1) || (m->getBody0() == body1 && m->getBody1() == body0)) return m;
+		}
+		return NULL;
 	}
 
-	struct sim_vehicle* get_vehicle(int i)
+	size_t snapshot_size()
 	{
-		ASSERT(i == 0);
-		return &vehicle;
+		/* every pair gets a manifold in snapshot(), even the ones without
+		 * contacts; plus room for pairs to come and go between snapshots */
+		int n_pairs = btMax(dispatcher->getNumManifolds(), overlappingPairCache->getOverlappingPairCache()->getNumOverlappingPairs());
+		int n_manifolds = n_pairs * 2 + vehicles.size() * 4 + 16;
+		return sizeof(struct sim_snapshot_header)
+			+ chunk_bodies.size() * sizeof(int)
+			+ pool_solvers.size() * sizeof(unsigned long)
+			+ count_dynamic_bodies() * sizeof(struct sim_snapshot_body)
+			+ vehicles.size() * sizeof(struct sim_snapshot_vehicle)
+			+ n_manifolds * sizeof(struct sim_snapshot_manifold);
 	}
 
-	void initialize()
+	size_t snapshot(void* buf, size_t sz)
 	{
-		_initialize_world();
-		vehicle.initialize(world);
+		ASSERT(thread == NULL);
+		ASSERT(n_far == 0); // far chassis aren't in the world; see sim_set_lod_path()
+
+		/* the contacts go through the rebuild by body pair; a pair whose
+		 * AABBs no longer touch is gone, as it would be after the next
+		 * step's broadphase update */
+		rebuild_contacts.resize(0);
+		for (int i = 0; i < dispatcher->getNumManifolds(); i++) {
+			btPersistentManifold* m = dispatcher->getManifoldByIndexInternal(i);
+			if (m->getNumContacts() == 0) continue;
+			struct sim_manifold_copy& copy = rebuild_contacts.expandNonInitializing();
+			copy.body0 = m->getBody0();
+			copy.body1 = m->getBody1();
+			copy.n_contacts = m->getNumContacts();
+			for (int j = 0; j < copy.n_contacts; j++) copy.points[j] = m->getContactPoint(j);
+		}
+		rebuild_broadphase();
+		for (int i = 0; i < dispatcher->getNumManifolds(); i++) {
+			dispatcher->getManifoldByIndexInternal(i)->clearManifold();
+		}
+		for (int i = 0; i < rebuild_contacts.size(); i++) {
+			struct sim_manifold_copy& copy = rebuild_contacts[i];
+			btPersistentManifold* m = find_manifold(copy.body0, copy.body1);
+			if (m == NULL) continue;
+			int swapped = m->getBody0() != copy.body0;
+			m->setNumContacts(copy.n_contacts);
+			for (int j = 0; j < copy.n_contacts; j++) {
+				m->getContactPoint(j) = copy.points[j];
+				if (swapped) sim_swap_contact(&m->getContactPoint(j));
+			}
+		}
+
+		struct sim_snapshot_header header;
+		memset(&header, 0, sizeof(struct sim_snapshot_header));
+		header.magic = SIM_SNAPSHOT_MAGIC;
+		header.n_bodies = count_dynamic_bodies();
+		header.n_vehicles = vehicles.size();
+		header.n_manifolds = dispatcher->getNumManifolds();
+		header.rand_seed = ((btSequentialImpulseConstraintSolver*)constraintSolver)->getRandSeed();
+		header.accumulator = accumulator;
+		header.n_active_chunks = active_chunks.size();
+		header.n_pool_seeds = pool_solvers.size();
+		header.retire_cursor = retire_cursor;
+		for (int k = 0; k < 3; k++) header.origin[k] = origin[k];
+		ASSERT(header.n_bodies == vehicles.size());
+
+		size_t total = sizeof(struct sim_snapshot_header)
+			+ header.n_active_chunks * sizeof(int)
+			+ header.n_pool_seeds * sizeof(unsigned long)
+			+ header.n_bodies * sizeof(struct sim_snapshot_body)
+			+ header.n_vehicles * sizeof(struct sim_snapshot_vehicle)
+			+ header.n_manifolds * sizeof(struct sim_snapshot_manifold);
+		if (total > sz) return 0;
+		header.size = total;
+
+		struct sim_snapshot_cursor cur;
+		cur.p = (char*)buf;
+		cur.end = cur.p + sz;
+		cur.put(&header, sizeof(struct sim_snapshot_header));
+		for (int i = 0; i < active_chunks.size(); i++) cur.put(&active_chunks[i], sizeof(int));
+		for (int i = 0; i < pool_solvers.size(); i++) {
+			unsigned long seed = ((btSequentialImpulseConstraintSolver*)pool_solvers[i])->getRandSeed();
+			cur.put(&seed, sizeof(unsigned long));
+		}
+
+		for (int i = 0; i < vehicles.size(); i++) {
+			btRigidBody* body = vehicles[i]->chassis;
+			struct sim_snapshot_body rec;
+			rec.world_transform = body->getWorldTransform();
+			rec.interpolation_world_transform = body->getInterpolationWorldTransform();
+			if (body->getMotionState() != NULL) {
+				body->getMotionState()->getWorldTransform(rec.motion_state_transform);
+			} else {
+				rec.motion_state_transform.setIdentity();
+			}
+			rec.linear_velocity = body->getLinearVelocity();
+			rec.angular_velocity = body->getAngularVelocity();
+			rec.interpolation_linear_velocity = body->getInterpolationLinearVelocity();
+			rec.interpolation_angular_velocity = body->getInterpolationAngularVelocity();
+			rec.total_force = body->getTotalForce();
+			rec.total_torque = body->getTotalTorque();
+			rec.activation_state = body->getActivationState();
+			rec.deactivation_time = body->getDeactivationTime();
+			rec.hit_fraction = body->getHitFraction();
+			cur.put(&rec, sizeof(struct sim_snapshot_body));
+		}
 
-		add_ground();
+		for (int i = 0; i < vehicles.size(); i++) {
+			vehicles[i]->save_wheels(&cur);
+			cur.put(&state_prev[i], sizeof(struct sim_vehicle_state));
+			cur.put(&state_cur[i], sizeof(struct sim_vehicle_state));
+		}
+
+		for (int i = 0; i < header.n_manifolds; i++) {
+			btPersistentManifold* m = dispatcher->getManifoldByIndexInternal(i);
+			struct sim_snapshot_manifold rec;
+			rec.object0 = m->getBody0()->getWorldArrayIndex();
+			rec.object1 = m->getBody1()->getWorldArrayIndex();
+			rec.n_contacts = m->getNumContacts();
+			for (int j = 0; j < rec.n_contacts; j++) rec.points[j] = m->getContactPoint(j);
+			cur.put(&rec, sizeof(struct sim_snapshot_manifold));
+		}
+
+		ASSERT((size_t)(cur.p - (char*)buf) == total);
+		return total;
 	}
 
-	int step(float dt)
+	/* brings the streamed chunks back to the snapshot's set, in its order.
+	 * a chunk that was retired meanwhile comes back as a new body; its
+	 * contacts come back with the manifolds */
+	void restore_chunks(struct sim_snapshot_cursor* cur, int n)
 	{
-		int max_steps = 128;
-		float fixed_dt = 1.0f / 60.0f;
-		return world->stepSimulation(dt, max_steps, fixed_dt);
+		ASSERT(n == 0 || stream_radius > 0);
+		ASSERT(cur->fits(n * sizeof(int)));
+		const char* ids = cur->p;
+		cur->p += n * sizeof(int);
+
+		// mark what to keep, retire the rest
+		for (int i = 0; i < n; i++) {
+			int c;
+			memcpy(&c, ids + i * sizeof(int), sizeof(int));
+			ASSERT(c >= 0 && c < chunk_bodies.size());
+			if (chunk_bodies[c].body == NULL) activate_chunk(c);
+			chunk_bodies[c].body->setUserIndex(1);
+		}
+		for (int i = active_chunks.size() - 1; i >= 0; i--) {
+			btRigidBody* body = chunk_bodies[active_chunks[i]].body;
+			if (body->getUserIndex() == 1) {
+				body->setUserIndex(0);
+			} else {
+				retire_chunk(i);
+			}
+		}
+		ASSERT(active_chunks.size() == n);
+		for (int i = 0; i < n; i++) memcpy(&active_chunks[i], ids + i * sizeof(int), sizeof(int));
 	}
 
-	void add_block(struct vec3* points, int n_points)
+	void restore(const void* buf)
 	{
-		btConvexHullShape* shape = new btConvexHullShape;
-		for (int i = 0; i < n_points; i++) {
-			struct vec3* p = &points[i];
-			btVector3 btp(p->s[0], p->s[1], p->s[2]);
-			shape->addPoint(btp);
+		ASSERT(thread == NULL);
+
+		struct sim_snapshot_cursor cur;
+		cur.p = (char*)buf;
+		cur.end = cur.p + sizeof(struct sim_snapshot_header);
+
+		struct sim_snapshot_header header;
+		cur.get(&header, sizeof(struct sim_snapshot_header));
+		ASSERT(header.magic == SIM_SNAPSHOT_MAGIC);
+		ASSERT(header.n_bodies == count_dynamic_bodies());
+		ASSERT(header.n_vehicles == vehicles.size());
+		cur.end = (char*)buf + header.size;
+
+		((btSequentialImpulseConstraintSolver*)constraintSolver)->setRandSeed(header.rand_seed);
+		accumulator = header.accumulator;
+		shift_origin(btVector3(header.origin[0], header.origin[1], header.origin[2]) - origin);
+		restore_chunks(&cur, header.n_active_chunks);
+		retire_cursor = header.retire_cursor;
+		ASSERT(header.n_pool_seeds == pool_solvers.size());
+		for (int i = 0; i < pool_solvers.size(); i++) {
+			unsigned long seed;
+			cur.get(&seed, sizeof(unsigned long));
+			((btSequentialImpulseConstraintSolver*)pool_solvers[i])->setRandSeed(seed);
 		}
 
-		btTransform tx;
-		tx.setIdentity();
+		for (int i = 0; i < vehicles.size(); i++) {
+			btRigidBody* body = vehicles[i]->chassis;
+			struct sim_snapshot_body rec;
+			cur.get(&rec, sizeof(struct sim_snapshot_body));
+			body->setWorldTransform(rec.world_transform);
+			body->setInterpolationWorldTransform(rec.interpolation_world_transform);
+			if (body->getMotionState() != NULL) {
+				body->getMotionState()->setWorldTransform(rec.motion_state_transform);
+			}
+			body->setLinearVelocity(rec.linear_velocity);
+			body->setAngularVelocity(rec.angular_velocity);
+			body->setInterpolationLinearVelocity(rec.interpolation_linear_velocity);
+			body->setInterpolationAngularVelocity(rec.interpolation_angular_velocity);
+			body->clearForces();
+			body->applyCentralForce(rec.total_force);
+			body->applyTorque(rec.total_torque);
+			body->forceActivationState(rec.activation_state);
+			body->setDeactivationTime(rec.deactivation_time);
+			body->setHitFraction(rec.hit_fraction);
+		}
 
-		btDefaultMotionState* mstate = new btDefaultMotionState(tx);
-		btRigidBody::btRigidBodyConstructionInfo cinfo(0, mstate, shape);
-		btRigidBody* body = new btRigidBody(cinfo);
-		body->setContactProcessingThreshold(1e3); // ???
-		world->addRigidBody(body);
+		for (int i = 0; i < vehicles.size(); i++) {
+			vehicles[i]->load_wheels(&cur);
+			cur.get(&state_prev[i], sizeof(struct sim_vehicle_state));
+			cur.get(&state_cur[i], sizeof(struct sim_vehicle_state));
+		}
+
+		/* same bodies in the same places as when snapshot() rebuilt the
+		 * broadphase, so this one comes out with the same pairs and
+		 * manifolds, in the same order; only their contacts differ */
+		rebuild_broadphase();
+		ASSERT(header.n_manifolds == dispatcher->getNumManifolds());
+		for (int i = 0; i < header.n_manifolds; i++) {
+			btPersistentManifold* m = dispatcher->getManifoldByIndexInternal(i);
+			struct sim_snapshot_manifold rec;
+			cur.get(&rec, sizeof(struct sim_snapshot_manifold));
+			ASSERT(rec.object0 == m->getBody0()->getWorldArrayIndex());
+			ASSERT(rec.object1 == m->getBody1()->getWorldArrayIndex());
+			m->setNumContacts(rec.n_contacts);
+			for (int k = 0; k < rec.n_contacts; k++) m->getContactPoint(k) = rec.points[k];
+		}
+
+		publish_poses();
+		latch_poses();
+	}
+
+	void get_stats(struct sim_stats* stats)
+	{
+		ASSERT(thread == NULL);
+		stats->body_count = world->getNumCollisionObjects();
+		stats->track_build_time = track_build_time;
+		stats->step_count = step_count;
+		stats->step_time = step_count > 0 ? step_time / (double)step_count : 0;
+		stats->n_threads = n_threads;
+		stats->step_cost = step_cost;
+		stats->lag = get_lag();
+		stats->time_dropped = time_dropped;
+		stats->time_scale = time_scale;
+		stats->quality = quality;
+		stats->lod_far = n_far;
 	}
 
 	void add_ground()
@@ -151,21 +3221,246 @@ struct sim {
 		btRigidBody* body = new btRigidBody(cinfo);
 		body->setContactProcessingThreshold(1e6); // ???
 		world->addRigidBody(body);
+		ground_body = body;
+		ground_height = translation[1] + extents[1];
+	}
+};
+
+void* sim_vehicle_raycaster::castRay(const btVector3& from, const btVector3& to, btVehicleRaycasterResult& result)
+{
+	const btCollisionObject* hit = NULL;
+	btScalar fraction = 1;
+	btVector3 normal(0,1,0);
+
+	bool dynamic_only = sim->n_blocks == 0;
+	if (dynamic_only) {
+		btScalar f;
+		btVector3 n;
+		if (sim->track_mesh != NULL && sim->track_mesh->grid.raycast(from, to, sim->origin, &f, &n) && f < fraction) {
+			hit = sim->track_body;
+			fraction = f;
+			normal = n;
+		}
+
+		btScalar h = sim->ground_height;
+		if (from[1] >= h && to[1] < h) {
+			f = (from[1] - h) / (from[1] - to[1]);
+			if (f < fraction) {
+				hit = sim->ground_body;
+				fraction = f;
+				normal = btVector3(0,1,0);
+			}
+		}
+	}
+
+	if (!dynamic_only || sim->vehicles.size() > 1) {
+		sim_dynamic_ray_callback cb(from, to, self, dynamic_only);
+		sim->world->rayTest(from, to, cb);
+		if (cb.hasHit() && cb.m_closestHitFraction < fraction) {
+			const btRigidBody* body = btRigidBody::upcast(cb.m_collisionObject);
+			if (body != NULL && body->hasContactResponse()) {
+				hit = body;
+				fraction = cb.m_closestHitFraction;
+				normal = cb.m_hitNormalWorld;
+				normal.normalize();
+			}
+		}
+	}
+
+	if (hit == NULL) return NULL;
+	result.m_hitPointInWorld = from.lerp(to, fraction);
+	result.m_hitNormalInWorld = normal;
+	result.m_distFraction = fraction;
+	return (void*)hit;
+}
+
+/* several independent sims stepped in parallel, one sim per job. they
+ * share the track collision shape, which is only ever read while stepping.
+ * NOTE Bullet's built-in profiler (BT_PROFILE) is only thread safe from
+ * 2.87 on; older Bullets must be built with BT_NO_PROFILE for this */
+struct sim_pool {
+	struct sim** sims;
+	int n_sims;
+	struct sim_track_mesh* track_mesh;
+	struct sim_workers workers;
+	int steps; // per job in step_fixed()
+
+	void initialize(int n, int n_threads)
+	{
+		ASSERT(n >= 1);
+		n_sims = n;
+		sims = new struct sim*[n_sims];
+		for (int i = 0; i < n_sims; i++) {
+			sims[i] = new struct sim;
+			sims[i]->initialize(1);
+		}
+		track_mesh = NULL;
+
+		if (n_threads <= 0) n_threads = std::thread::hardware_concurrency();
+		if (n_threads <= 0) n_threads = 1;
+		if (n_threads > n_sims) n_threads = n_sims;
+		workers.start(n_threads);
+	}
+
+	void set_track_mesh(struct vec3* vertices, int n_vertices, int32_t* indices, int n_triangles)
+	{
+		ASSERT(track_mesh == NULL);
+		track_mesh = new struct sim_track_mesh;
+		track_mesh->build(vertices, n_vertices, indices, n_triangles);
+		for (int i = 0; i < n_sims; i++) {
+			sims[i]->set_track_mesh(track_mesh);
+		}
+	}
+
+	static void step_job(void* usr, int i)
+	{
+		struct sim_pool* pool = (struct sim_pool*)usr;
+		struct sim* sim = pool->sims[i];
+		for (int j = 0; j < pool->steps; j++) sim->step_fixed();
+		sim->publish_poses();
+		sim->accumulator = 0;
+		sim->latch_poses();
+	}
+
+	void step_fixed(int n)
+	{
+		steps = n;
+		workers.run(n_sims, step_job, this);
+	}
+
+	// the sims don't own the mesh, so it goes last
+	void destroy()
+	{
+		workers.stop();
+		for (int i = 0; i < n_sims; i++) {
+			sims[i]->destroy();
+			delete sims[i];
+		}
+		delete[] sims;
+		if (track_mesh != NULL) {
+			track_mesh->release();
+			delete track_mesh;
+		}
 	}
 };
 
 extern "C" {
 
-struct sim* sim_new()
+struct sim* sim_new(int n_threads)
 {
 	struct sim* sim = new struct sim;
-	sim->initialize();
+	sim->initialize(n_threads);
 	return sim;
 }
 
-int sim_step(struct sim* sim, float dt)
+void sim_free(struct sim* sim)
+{
+	sim->destroy();
+	delete sim;
+}
+
+void sim_reset(struct sim* sim)
+{
+	sim->reset();
+}
+
+int sim_set_task_scheduler(const char* name)
+{
+	#ifdef SIM_MT
+	sim_install_allocator();
+	btITaskScheduler* scheduler = NULL;
+	if (strcmp(name, "default") == 0) {
+		scheduler = sim_default_task_scheduler();
+	} else if (strcmp(name, "sequential") == 0) {
+		scheduler = btGetSequentialTaskScheduler();
+	} else if (strcmp(name, "openmp") == 0) {
+		scheduler = btGetOpenMPTaskScheduler();
+	} else if (strcmp(name, "tbb") == 0) {
+		scheduler = btGetTBBTaskScheduler();
+	} else if (strcmp(name, "ppl") == 0) {
+		scheduler = btGetPPLTaskScheduler();
+	}
+	// NULL if Bullet wasn't built with it
+	if (scheduler == NULL) return 0;
+	btSetTaskScheduler(scheduler);
+	sim_scheduler_chosen.store(1);
+	return 1;
+	#else
+	(void)name;
+	return 0;
+	#endif
+}
+
+int sim_step(struct sim* sim, double dt)
+{
+	return sim->step(dt, -1);
+}
+
+int sim_step_limited(struct sim* sim, double dt, int max_steps)
+{
+	ASSERT(max_steps >= 0);
+	return sim->step(dt, max_steps);
+}
+
+void sim_step_fixed(struct sim* sim, int n)
+{
+	ASSERT(sim->thread == NULL);
+	for (int i = 0; i < n; i++) sim->step_fixed();
+	sim->publish_poses();
+	sim->accumulator = 0;
+	sim->latch_poses();
+}
+
+void sim_set_quality(struct sim* sim, int quality)
+{
+	sim->set_quality(quality);
+}
+
+int sim_get_quality(struct sim* sim)
+{
+	return sim->quality;
+}
+
+void sim_set_quality_auto(struct sim* sim, int enabled)
+{
+	sim->quality_auto = enabled;
+	sim->quality_timer = 0;
+	sim->quality_time_dropped = sim->time_dropped;
+}
+
+const char* sim_quality_name(int quality)
+{
+	ASSERT(quality >= 0 && quality < SIM_QUALITY_COUNT);
+	return sim_quality_tiers[quality].name;
+}
+
+int sim_quality_from_name(const char* name)
+{
+	for (int i = 0; i < SIM_QUALITY_COUNT; i++) {
+		if (strcmp(name, sim_quality_tiers[i].name) == 0) return i;
+	}
+	return -1;
+}
+
+void sim_set_step_budget(struct sim* sim, double seconds)
+{
+	ASSERT(seconds >= 0);
+	sim->step_budget = seconds;
+}
+
+double sim_get_lag(struct sim* sim)
+{
+	return sim->get_lag();
+}
+
+void sim_set_step_rate(struct sim* sim, int hz)
+{
+	sim->set_step_rate(hz);
+}
+
+float sim_get_step_dt(struct sim* sim)
 {
-	return sim->step(dt);
+	return sim->fixed_dt;
 }
 
 void sim_add_block(struct sim* sim, struct vec3* points, int n_points)
@@ -173,91 +3468,203 @@ void sim_add_block(struct sim* sim, struct vec3* points, int n_points)
 	sim->add_block(points, n_points);
 }
 
+void sim_set_track_streaming(struct sim* sim, float radius)
+{
+	sim->set_track_streaming(radius);
+}
+
+void sim_set_track_mesh(struct sim* sim, struct vec3* vertices, int n_vertices, int32_t* indices, int n_triangles)
+{
+	struct sim_track_mesh* mesh = new struct sim_track_mesh;
+	mesh->build(vertices, n_vertices, indices, n_triangles);
+	sim->track_build_time += mesh->build_time;
+	sim->own_track_mesh = 1;
+	sim->set_track_mesh(mesh);
+}
+
+uint64_t sim_state_hash(struct sim* sim)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (int i = 0; i < sim->state_cur.size(); i++) {
+		const unsigned char* p = (const unsigned char*)&sim->state_cur[i];
+		for (size_t j = 0; j < sizeof(struct sim_vehicle_state); j++) {
+			h ^= p[j];
+			h *= 0x100000001b3ULL;
+		}
+	}
+	return h;
+}
+
+size_t sim_snapshot_size(struct sim* sim)
+{
+	return sim->snapshot_size();
+}
+
+size_t sim_snapshot(struct sim* sim, void* buf, size_t sz)
+{
+	return sim->snapshot(buf, sz);
+}
+
+void sim_restore(struct sim* sim, const void* buf)
+{
+	sim->restore(buf);
+}
+
+void sim_raycast_batch(struct sim* sim, const struct sim_ray* rays, struct sim_ray_hit* hits, int n)
+{
+	sim->raycast_batch(rays, hits, n);
+}
+
+void sim_set_lod_path(struct sim* sim, struct vec3* points, int n, int closed)
+{
+	sim->set_lod_path(points, n, closed);
+}
+
+void sim_set_lod_focus(struct sim* sim, struct vec3* position, struct vec3* direction)
+{
+	btVector3 p(position->s[0], position->s[1], position->s[2]);
+	btVector3 d(direction->s[0], direction->s[1], direction->s[2]);
+	sim->set_lod_focus(p, d);
+}
+
+void sim_get_origin(struct sim* sim, struct vec3* origin)
+{
+	vec3_from_btVector3(origin, sim->frame_origin);
+}
+
+void sim_get_stats(struct sim* sim, struct sim_stats* stats)
+{
+	sim->get_stats(stats);
+}
+
+struct sim_pool* sim_pool_new(int n_sims, int n_threads)
+{
+	struct sim_pool* pool = new struct sim_pool;
+	pool->initialize(n_sims, n_threads);
+	return pool;
+}
+
+void sim_pool_free(struct sim_pool* pool)
+{
+	pool->destroy();
+	delete pool;
+}
+
+void sim_pool_set_track_mesh(struct sim_pool* pool, struct vec3* vertices, int n_vertices, int32_t* indices, int n_triangles)
+{
+	pool->set_track_mesh(vertices, n_vertices, indices, n_triangles);
+}
+
+int sim_pool_size(struct sim_pool* pool)
+{
+	return pool->n_sims;
+}
+
+int sim_pool_thread_count(struct sim_pool* pool)
+{
+	return pool->workers.n_threads + 1;
+}
+
+struct sim* sim_pool_get_sim(struct sim_pool* pool, int i)
+{
+	ASSERT(i >= 0 && i < pool->n_sims);
+	return pool->sims[i];
+}
+
+void sim_pool_step_fixed(struct sim_pool* pool, int n)
+{
+	pool->step_fixed(n);
+}
+
 struct sim_vehicle* sim_get_vehicle(struct sim* sim, int i)
 {
 	return sim->get_vehicle(i);
 }
 
-static void mat44_from_btTransform(struct mat44* tx, btTransform btx)
+int sim_add_vehicle(struct sim* sim, struct vec3* position, float yaw)
 {
-	mat44_set_identity(tx);
-	btx.getOpenGLMatrix(&tx->s[0]);
+	return sim->add_vehicle(btVector3(position->s[0], position->s[1], position->s[2]), yaw, 0);
 }
 
-static void vec3_from_btVector3(struct vec3* v, btVector3 btv)
+int sim_add_lite_vehicle(struct sim* sim, struct vec3* position, float yaw)
 {
-	for (int i = 0; i < 3; i++) v->s[i] = btv[i];
+	return sim->add_vehicle(btVector3(position->s[0], position->s[1], position->s[2]), yaw, 1);
 }
 
-void sim_vehicle_get_tx(struct sim_vehicle* vehicle, struct mat44* tx)
+int sim_vehicle_count(struct sim* sim)
 {
-	btRigidBody* body = vehicle->raycastVehicle->getRigidBody();
-	//btRigidBody* body = vehicle->chassis;
+	return sim->vehicles.size();
+}
 
-	btTransform transform;
-	body->getMotionState()->getWorldTransform(transform);
+void sim_apply_controls(struct sim* sim, const struct sim_ctrl* ctrls, int n)
+{
+	sim->apply_controls(ctrls, n);
+}
 
-	struct mat44 a;
-	mat44_from_btTransform(&a, transform);
-	mat44_inverse(tx, &a);
+void sim_get_poses(struct sim* sim, struct mat44* out, int n)
+{
+	sim->get_poses(out, n);
 }
 
-void sim_vehicle_render(struct render* render, struct sim_vehicle* vehicle)
+void sim_get_transforms(struct sim* sim, struct sim_transforms* transforms)
 {
-	// render wheels
-	for (int w = 0; w < 4; w++) {
-		btWheelInfo& wheel = vehicle->raycastVehicle->getWheelInfo(w);
-		struct mat44 wtx;
-		mat44_from_btTransform(&wtx, wheel.m_worldTransform);
-		render_a_wheel(render, &wtx, WHEEL_RADIUS, 0.08);
-	}
+	struct sim_transform_buffer* buf = &sim->frame_transforms;
+	transforms->n = buf->n;
+	transforms->cap = buf->cap;
+	transforms->n_vehicles = sim->frame_poses.size();
+	transforms->columns = buf->n > 0 ? &buf->columns[0] : NULL;
+}
 
-	// render chassis
-	{
-		struct mat44 wtx;
-		btTransform btx;
-		vehicle->chassis->getMotionState()->getWorldTransform(btx);
-		mat44_from_btTransform(&wtx, btx);
-		struct vec3 extents;
-		vec3_from_btVector3(&extents, vehicle->chassis_extents);
-		render_box(render, &wtx, &extents);
-	}
+void sim_thread_start(struct sim* sim)
+{
+	sim->thread_start();
 }
 
-void sim_vehicle_ctrl(struct sim_vehicle* vehicle, int accel, int brake, int steer)
+void sim_thread_stop(struct sim* sim)
 {
-	for (int w = 0; w < 4; w++) {
-		/*
-		float aforce = accel ? 1000 : 0;
-		float bforce = brake ? 300 : 0;
-		vehicle->raycastVehicle->applyEngineForce(aforce, w);
-		vehicle->raycastVehicle->setBrake(bforce, w);
-		*/
-	}
-	float aforce = accel ? 1000 : 0;
-	float bforce = brake ? 100 : 0;
-	for (int w = 0; w < 2; w++) {
-		vehicle->raycastVehicle->applyEngineForce(aforce, w);
-		vehicle->raycastVehicle->setSteeringValue((float)steer * -0.4f, w);
+	sim->thread_stop();
+}
+
+void sim_latch_poses(struct sim* sim)
+{
+	sim->latch_poses();
+}
 
-		vehicle->raycastVehicle->setBrake(bforce, w+2);
+void sim_vehicle_get_tx(struct sim_vehicle* vehicle, struct mat44* tx)
+{
+	struct mat44 chassis;
+	vehicle->sim->frame_transforms.get(vehicle->index, &chassis);
+	mat44_inverse(tx, &chassis);
+}
 
-	}
-	//printf("%f\n", vehicle->raycastVehicle->getCurrentSpeedKmHour());
+void sim_vehicle_get_pose(struct sim_vehicle* vehicle, struct sim_vehicle_pose* pose)
+{
+	vehicle->sim->get_vehicle_pose(vehicle->index, pose);
 }
 
-void sim_vehicle_visualize(struct sim_vehicle* vehicle, struct render* render)
+void sim_vehicle_ctrl(struct sim_vehicle* vehicle, int accel, int brake, int steer)
 {
-	//render_begin_color(render);
-	for (int w = 0; w < 4; w++) {
-		btWheelInfo& wheel = vehicle->raycastVehicle->getWheelInfo(w);
-		struct vec3 o, v;
-		vec3_from_btVector3(&o, wheel.m_raycastInfo.m_hardPointWS);
-		vec3_from_btVector3(&v, wheel.m_raycastInfo.m_wheelDirectionWS);
-		render_draw_vector(render, &o, &v, NULL);
-	}
-	//render_end_color(render);
+	struct sim_ctrl c;
+	c.accel = accel;
+	c.brake = brake;
+	c.steer = steer;
+	vehicle->sim->vehicle_ctrl(vehicle, &c);
 }
 
-} /* extern "C" */
+void sim_vehicle_tuning_default(struct sim_vehicle_tuning* tuning)
+{
+	tuning->suspension_rest_length = 0.6;
+	tuning->suspension_stiffness = 10;
+	tuning->damping_relaxation = 2.3;
+	tuning->damping_compression = 4.4;
+	tuning->friction_slip = 100;
+	tuning->roll_influence = 0.1;
+}
 
+void sim_vehicle_set_tuning(struct sim_vehicle* vehicle, struct sim_vehicle_tuning* tuning)
+{
+	ASSERT(vehicle->sim->thread == NULL);
+	vehicle->set_tuning(tuning);
+}
+
+} /* extern "C" */
@@ -5,23 +5,232 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+#include <stddef.h>
+
 #include "a.h"
 #include "m.h"
-#include "render.h"
 
 struct sim_vehicle;
 struct sim;
+struct sim_pool;
+
+// per wheel; see sim_vehicle_tuning_default() for what the game uses
+struct sim_vehicle_tuning {
+	float suspension_rest_length;
+	float suspension_stiffness;
+	float damping_relaxation;
+	float damping_compression;
+	float friction_slip;
+	float roll_influence;
+};
+
+struct sim_ctrl {
+	int accel;
+	int brake;
+	int steer; // -1, 0 or 1
+};
+
+// a vehicle as it should be drawn this frame
+struct sim_vehicle_pose {
+	struct mat44 chassis;
+	struct vec3 chassis_extents;
+	struct mat44 wheels[4];
+	float wheel_radius;
+	struct vec3 wheel_hardpoints[4];
+	struct vec3 wheel_directions[4];
+};
 
-struct sim* sim_new();
-int sim_step(struct sim*, float dt);
+struct sim_stats {
+	int body_count;
+	double track_build_time; // seconds spent building track collision
+	int step_count;
+	double step_time; // average seconds per fixed step
+	int n_threads; // Bullet worker threads; 1 is the plain world
+	double step_cost; // recent seconds per fixed step, see sim_set_step_budget()
+	double lag; // see sim_get_lag()
+	double time_dropped; // real time skipped to stay within budget, seconds
+	double time_scale; // recent sim time / real time; < 1 when overloaded
+	int quality; // enum sim_quality
+	int lod_far; // vehicles following the path; see sim_set_lod_path()
+};
+
+/* quality tiers: step rate, solver iterations, split impulse and contact
+ * processing threshold. low is 30Hz with a cheap solver, medium the 60Hz
+ * default, high and ultra 120 and 240Hz */
+enum sim_quality {
+	SIM_QUALITY_LOW = 0,
+	SIM_QUALITY_MEDIUM,
+	SIM_QUALITY_HIGH,
+	SIM_QUALITY_ULTRA,
+	SIM_QUALITY_COUNT
+};
+
+/* n_threads > 1 selects Bullet's multithreaded world (narrowphase and
+ * island solving run on the task scheduler); needs a SIM_MT build, and
+ * falls back to the single threaded world otherwise */
+struct sim* sim_new(int n_threads);
+/* deletes the sim and everything in it, including its track mesh (but
+ * not a sim_pool's). not while threaded */
+void sim_free(struct sim*);
+/* back to how sim_new() left it, keeping the track mesh (built once, so a
+ * restart costs no BVH builds), the streaming and LOD paths and the step
+ * rate and quality settings. blocks and vehicles past 0 are gone; add
+ * them again. not while threaded */
+void sim_reset(struct sim*);
+/* installs Bullet's task scheduler by name: "default", "sequential",
+ * "openmp", "tbb" or "ppl". global, so call before sim_new(). returns 0
+ * if unavailable in this build */
+int sim_set_task_scheduler(const char* name);
+/* advances the sim by dt seconds of real time in fixed steps; whatever
+ * doesn't fit a whole step is carried over and used to interpolate the
+ * poses between the last two steps. returns the number of steps taken */
+int sim_step(struct sim*, double dt);
+/* like sim_step(), but takes at most max_steps and keeps the time left
+ * over for the next call; so controls can change between exact steps */
+int sim_step_limited(struct sim*, double dt, int max_steps);
+// runs n fixed steps and publishes the resulting poses once
+void sim_step_fixed(struct sim*, int n);
+void sim_set_step_rate(struct sim*, int hz);
+/* wall clock seconds sim_step() may spend per call (default 8ms, 0 means
+ * no limit besides 128 steps). over budget the sim falls behind by a few
+ * steps at most and drops the rest; game time slows down rather than the
+ * frame rate collapsing */
+void sim_set_step_budget(struct sim*, double seconds);
+// seconds of real time the sim still owes; 0 unless it's overloaded
+double sim_get_lag(struct sim*);
+
+// not while threaded; overrides sim_set_step_rate()
+void sim_set_quality(struct sim*, int quality);
+int sim_get_quality(struct sim*);
+/* lets sim_step() move between tiers by measured step cost; not with
+ * replays, since tier changes aren't recorded */
+void sim_set_quality_auto(struct sim*, int enabled);
+const char* sim_quality_name(int quality);
+int sim_quality_from_name(const char* name); // -1 if unknown
+float sim_get_step_dt(struct sim*);
 void sim_add_block(struct sim*, struct vec3* points, int n_points);
+// builds a single static BVH triangle mesh body; call at most once
+void sim_set_track_mesh(struct sim*, struct vec3* vertices, int n_vertices, int32_t* indices, int n_triangles);
+/* instead of one body for the whole track, keep only the track chunks
+ * (square tiles) within radius of a vehicle in the world, so the broadphase
+ * and the BVHs scale with vehicles rather than track length. chunks are
+ * activated and retired a few per step; wheels see the whole track either
+ * way. call before sim_set_track_mesh(); 0 turns it off */
+void sim_set_track_streaming(struct sim*, float radius);
+void sim_get_stats(struct sim*, struct sim_stats* stats);
+/* floating origin: once vehicle 0 gets a few hundred meters out, the sim
+ * moves everything back around it. positions going in and out of the sim
+ * (vehicles, poses, transforms, rays) are relative to this origin; the
+ * track mesh and blocks are given in world coordinates. this is the origin
+ * of the current frame's poses */
+void sim_get_origin(struct sim*, struct vec3* origin);
+
+/* physics LOD: given the track's center line (world coordinates, see
+ * track_path_build()), vehicles far from the focus, or not as far but
+ * behind it, drop out of the world and just follow the line at the speed
+ * they had, until they come near again. vehicle 0 never does. far vehicles
+ * collide with nothing and don't show up in sim_raycast_batch(). not while
+ * threaded, and not with snapshots or replays, since the focus isn't
+ * recorded; n < 2 turns it off */
+void sim_set_lod_path(struct sim*, struct vec3* points, int n, int closed);
+/* usually the camera; position and view direction in the coordinates of
+ * the current frame's poses. vehicle 0 until this is called */
+void sim_set_lod_focus(struct sim*, struct vec3* position, struct vec3* direction);
+
+/* flat copy of the dynamic state (bodies, wheels, contacts, interpolation)
+ * into a caller-owned buffer; no allocation either way, and restoring then
+ * stepping with the same controls continues bit-identically. both put the
+ * world's bodies, pairs and contacts in one fixed order, so the run after
+ * a snapshot isn't bit-identical to the same run without one. a snapshot
+ * only restores into the sim it came from, with the same vehicles.
+ * sim_snapshot_size() is a bound for the current state with some slack for
+ * contacts; sim_snapshot() returns the bytes written, or 0 if the buffer
+ * is too small. not while threaded */
+size_t sim_snapshot_size(struct sim*);
+size_t sim_snapshot(struct sim*, void* buf, size_t sz);
+void sim_restore(struct sim*, const void* buf);
+/* FNV-1a over the bits of every vehicle's state after the last step (not
+ * interpolated); equal hashes mean the runs went exactly the same way */
+uint64_t sim_state_hash(struct sim*);
+
+struct sim_ray {
+	struct vec3 from;
+	struct vec3 to;
+};
+
+struct sim_ray_hit {
+	int hit; // 0 on a miss, and then the rest is left alone
+	float fraction; // along from->to
+	struct vec3 position;
+	struct vec3 normal;
+	int vehicle; // -1 for the track, the ground and blocks
+};
+
+/* nearest hit for each of n rays, against the state after the last step.
+ * the rays are split over worker threads (started on first use) that only
+ * read the collision world, so no step may be in progress: not while
+ * threaded. nothing is allocated per call once the sim's body count has
+ * settled */
+void sim_raycast_batch(struct sim* sim, const struct sim_ray* rays, struct sim_ray_hit* hits, int n);
+
+/* threaded mode: the sim steps itself at a fixed rate on its own thread;
+ * sim_step() must not be called meanwhile. controls are queued, and poses
+ * are only picked up by sim_latch_poses(), so call that once per frame */
+void sim_thread_start(struct sim*);
+void sim_thread_stop(struct sim*);
+void sim_latch_poses(struct sim*);
+
+/* vehicle 0 is created by sim_new(); more can be added, but not while
+ * threaded. yaw is in radians */
+int sim_add_vehicle(struct sim* sim, struct vec3* position, float yaw);
+/* the same, on the lightweight backend meant for big AI fields: no
+ * btRaycastVehicle; every lite vehicle's wheels live in shared arrays and
+ * are updated together, with a simpler tire model. the chassis is still a
+ * Bullet body, so lite vehicles collide with everything else */
+int sim_add_lite_vehicle(struct sim* sim, struct vec3* position, float yaw);
+int sim_vehicle_count(struct sim* sim);
 struct sim_vehicle* sim_get_vehicle(struct sim* sim, int i);
 
+// controls for vehicles [0;n)
+void sim_apply_controls(struct sim* sim, const struct sim_ctrl* ctrls, int n);
+// interpolated transforms of vehicles [0;n); SIM_POSE_MATRICES per vehicle,
+// chassis first, then the four wheels
+#define SIM_POSE_MATRICES (5)
+void sim_get_poses(struct sim* sim, struct mat44* out, int n);
+
+/* every dynamic body transform for the current frame (interpolated), in
+ * one 16-byte aligned structure-of-arrays block owned by the sim, meant to
+ * be uploaded as is for instancing. column c (0..3) of transform i is the
+ * vec4 at columns + (c*cap + i)*4, so each column is a tightly packed vec4
+ * array and the block is 4*cap*4 floats. the n_vehicles chassis come first,
+ * then 4 wheels per vehicle. valid until the next sim_step() or
+ * sim_latch_poses() */
+struct sim_transforms {
+	int n;
+	int cap;
+	int n_vehicles;
+	float* columns;
+};
+void sim_get_transforms(struct sim* sim, struct sim_transforms* transforms);
+
 void sim_vehicle_get_tx(struct sim_vehicle* vehicle, struct mat44* tx);
-void sim_vehicle_render(struct render* render, struct sim_vehicle* vehicle);
+void sim_vehicle_get_pose(struct sim_vehicle* vehicle, struct sim_vehicle_pose* pose);
 void sim_vehicle_ctrl(struct sim_vehicle* vehicle, int accel, int brake, int steer);
+void sim_vehicle_tuning_default(struct sim_vehicle_tuning* tuning);
+void sim_vehicle_set_tuning(struct sim_vehicle* vehicle, struct sim_vehicle_tuning* tuning);
 
-void sim_vehicle_visualize(struct sim_vehicle* vehicle, struct render* render);
+/* N independent sims sharing one track collision mesh, stepped in parallel
+ * on n_threads (0: one per core); meant for tuning sweeps */
+struct sim_pool* sim_pool_new(int n_sims, int n_threads);
+// stops the threads and frees every sim and the shared mesh
+void sim_pool_free(struct sim_pool* pool);
+void sim_pool_set_track_mesh(struct sim_pool* pool, struct vec3* vertices, int n_vertices, int32_t* indices, int n_triangles);
+int sim_pool_size(struct sim_pool* pool);
+int sim_pool_thread_count(struct sim_pool* pool);
+struct sim* sim_pool_get_sim(struct sim_pool* pool, int i);
+// sim_step_fixed() on every sim
+void sim_pool_step_fixed(struct sim_pool* pool, int n);
 
 #ifdef __cplusplus
 } /* extern "C" */
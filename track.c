@@ -1,9 +1,12 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
 
 #include "track.h"
 #include "a.h"
 #include "m.h"
+#include "magic.h"
 
 struct track_node* track_get_node(struct track* track, int index)
 {
@@ -64,6 +67,9 @@ void track_init_demo(struct track* track)
 		vec3_add_inplace(&c, &track->nodes[i].bezier.p[0].position);
 		vec3_copy(&track->nodes[i].bezier.p[1].position, &c);
 	}
+
+	memset(&track->bounds, 0, sizeof track->bounds);
+	for (int i = 0; i < track->node_count; i++) track_node_changed(track, i);
 }
 
 static void track_point_calc_mirrored(struct track_point* dst, struct track_point* a, struct track_point* b)
@@ -98,6 +104,89 @@ int track_node_bezier_derive_4_track_points(struct track* track, struct track_no
 	return 1;
 }
 
+static void track_mark_dirty(struct track* track, int index)
+{
+	struct track_bounds* b = &track->bounds;
+	if (b->dirty[index]) return;
+	b->dirty[index] = 1;
+	b->n_dirty++;
+}
+
+void track_node_changed(struct track* track, int index)
+{
+	struct track_node* node = track_get_node(track, index);
+	track_mark_dirty(track, index);
+	// the previous node's curve ends in our points
+	if (node->type == TRACK_BEZIER && node->bezier.prev >= 0 && node->bezier.prev < track->node_count) {
+		track_mark_dirty(track, node->bezier.prev);
+	}
+}
+
+static void track_node_bounds(struct track* track, int index)
+{
+	struct track_bounds* b = &track->bounds;
+	struct track_node* node = track_get_node(track, index);
+	struct track_point tps[4];
+	if (node->type != TRACK_BEZIER || !track_node_bezier_derive_4_track_points(track, &node->bezier, tps)) {
+		b->cx[index] = b->cy[index] = b->cz[index] = 0;
+		b->ex[index] = b->ey[index] = b->ez[index] = -1e30f;
+		b->bend[index] = 0;
+		return;
+	}
+
+	/* the curve stays inside the hull of its control points, the width
+	 * inside the largest control width, and the skirts reach down to y=0 */
+	struct vec3 lo, hi;
+	vec3_copy(&lo, &tps[0].position);
+	vec3_copy(&hi, &tps[0].position);
+	float w = 0;
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 3; j++) {
+			float v = tps[i].position.s[j];
+			if (v < lo.s[j]) lo.s[j] = v;
+			if (v > hi.s[j]) hi.s[j] = v;
+		}
+		float aw = fabsf(tps[i].width);
+		if (aw > w) w = aw;
+	}
+	if (lo.s[1] > 0) lo.s[1] = 0;
+	if (hi.s[1] < 0) hi.s[1] = 0;
+
+	b->cx[index] = (lo.s[0] + hi.s[0]) * 0.5f;
+	b->cy[index] = (lo.s[1] + hi.s[1]) * 0.5f;
+	b->cz[index] = (lo.s[2] + hi.s[2]) * 0.5f;
+	b->ex[index] = (hi.s[0] - lo.s[0]) * 0.5f + w;
+	b->ey[index] = (hi.s[1] - lo.s[1]) * 0.5f + w;
+	b->ez[index] = (hi.s[2] - lo.s[2]) * 0.5f + w;
+
+	float bend = 0;
+	for (int i = 0; i < 2; i++) {
+		struct track_point* t = &tps[i];
+		float dp = 0, dn = 0;
+		for (int j = 0; j < 3; j++) {
+			float vp = t[0].position.s[j] - 2*t[1].position.s[j] + t[2].position.s[j];
+			float vn = t[0].normal.s[j] - 2*t[1].normal.s[j] + t[2].normal.s[j];
+			dp += vp*vp;
+			dn += vn*vn;
+		}
+		float e = sqrtf(dp) + sqrtf(dn) * w + fabsf(t[0].width - 2*t[1].width + t[2].width);
+		if (e > bend) bend = e;
+	}
+	b->bend[index] = bend;
+}
+
+void track_update_bounds(struct track* track)
+{
+	struct track_bounds* b = &track->bounds;
+	if (b->n_dirty == 0) return;
+	for (int i = 0; i < TRACK_NODE_MAX && b->n_dirty > 0; i++) {
+		if (!b->dirty[i]) continue;
+		if (i < track->node_count) track_node_bounds(track, i);
+		b->dirty[i] = 0;
+		b->n_dirty--;
+	}
+}
+
 static void _bezier_stuff(struct track_point* tps, int i, int N, struct vec3* pa, struct vec3* pb, struct vec3* n, struct vec3* r)
 {
 	float t = (float)i / (float)N;
@@ -146,3 +235,116 @@ void track_points_construct_block(struct track_point* tps, int i, int N, struct
 	}
 }
 
+static void track_mesh_requires(struct track_mesh* mesh, int vertices, int triangles)
+{
+	if (mesh->n_vertices + vertices > mesh->vertices_cap) {
+		while (mesh->n_vertices + vertices > mesh->vertices_cap) {
+			mesh->vertices_cap = mesh->vertices_cap ? mesh->vertices_cap * 2 : 4096;
+		}
+		mesh->vertices = realloc(mesh->vertices, mesh->vertices_cap * sizeof(struct vec3));
+		AN(mesh->vertices);
+	}
+	if (mesh->n_triangles + triangles > mesh->triangles_cap) {
+		while (mesh->n_triangles + triangles > mesh->triangles_cap) {
+			mesh->triangles_cap = mesh->triangles_cap ? mesh->triangles_cap * 2 : 4096;
+		}
+		mesh->indices = realloc(mesh->indices, mesh->triangles_cap * 3 * sizeof(int32_t));
+		AN(mesh->indices);
+	}
+}
+
+static void track_mesh_add_quad(struct track_mesh* mesh, int base, int a, int b, int c, int d)
+{
+	int32_t* t = &mesh->indices[mesh->n_triangles * 3];
+	t[0] = base + a; t[1] = base + b; t[2] = base + c;
+	t[3] = base + a; t[4] = base + c; t[5] = base + d;
+	mesh->n_triangles += 2;
+}
+
+static void add_bezier_node_to_mesh(struct track_mesh* mesh, struct track* track, struct track_node_bezier* bezier)
+{
+	struct track_point tps[4];
+	if (!track_node_bezier_derive_4_track_points(track, bezier, tps)) return;
+
+	int N = BEZIER_SUBDIV;
+	for (int i = 0; i < N; i++) {
+		track_mesh_requires(mesh, 8, 6);
+		int base = mesh->n_vertices;
+		track_points_construct_block(tps, i, N, &mesh->vertices[base], NULL);
+		mesh->n_vertices += 8;
+
+		// same faces as render_road_node_bezier(); the bottom is never hit
+		track_mesh_add_quad(mesh, base, 0, 1, 2, 3);
+		track_mesh_add_quad(mesh, base, 0, 3, 7, 4);
+		track_mesh_add_quad(mesh, base, 2, 1, 5, 6);
+	}
+}
+
+void track_mesh_build(struct track_mesh* mesh, struct track* track)
+{
+	memset(mesh, 0, sizeof(struct track_mesh));
+	for (int i = 0; i < track->node_count; i++) {
+		struct track_node* node = track_get_node(track, i);
+		switch (node->type) {
+			case TRACK_BEZIER:
+				add_bezier_node_to_mesh(mesh, track, &node->bezier);
+				break;
+			case TRACK_DELETED: arghf("encountered TRACK_DELETED");
+				break;
+		}
+	}
+}
+
+void track_mesh_free(struct track_mesh* mesh)
+{
+	free(mesh->vertices);
+	free(mesh->indices);
+	memset(mesh, 0, sizeof(struct track_mesh));
+}
+
+static struct vec3* track_path_push(struct track_path* path)
+{
+	if (path->n == path->cap) {
+		path->cap = path->cap ? path->cap * 2 : 1024;
+		path->points = realloc(path->points, path->cap * sizeof(struct vec3));
+		AN(path->points);
+	}
+	return &path->points[path->n++];
+}
+
+void track_path_build(struct track_path* path, struct track* track)
+{
+	memset(path, 0, sizeof(struct track_path));
+
+	int first = -1;
+	for (int i = 0; i < track->node_count && first < 0; i++) {
+		if (track_get_node(track, i)->type == TRACK_BEZIER) first = i;
+	}
+	if (first < 0) return;
+
+	struct track_point tps[4];
+	int i = first;
+	for (int n = 0; n < track->node_count; n++) {
+		struct track_node* node = track_get_node(track, i);
+		ASSERT(node->type == TRACK_BEZIER);
+		if (!track_node_bezier_derive_4_track_points(track, &node->bezier, tps)) break;
+		for (int j = 0; j < BEZIER_SUBDIV; j++) {
+			float t = (float)j / (float)BEZIER_SUBDIV;
+			vec3_bezier(track_path_push(path), t, &tps[0].position, &tps[1].position, &tps[2].position, &tps[3].position);
+		}
+		i = node->bezier.next;
+		if (i == first) {
+			path->closed = 1;
+			return;
+		}
+	}
+
+	// open ended (or looping back somewhere else; XXX cut short there)
+	if (path->n > 0) vec3_copy(track_path_push(path), &tps[3].position);
+}
+
+void track_path_free(struct track_path* path)
+{
+	free(path->points);
+	memset(path, 0, sizeof(struct track_path));
+}
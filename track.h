@@ -35,17 +35,66 @@ struct track_node {
 
 #define TRACK_NODE_MAX (1<<14)
 
+/* per node axis aligned box around the road and its skirts, as center and
+ * half extents; structure of arrays so the renderer can cull four nodes at a
+ * time. nodes that draw nothing get negative extents, which never pass a
+ * frustum test. bend is the largest second difference of the node's
+ * control points (widths and width scaled normals included); the renderer
+ * picks its level of detail from it */
+struct track_bounds {
+	float cx[TRACK_NODE_MAX];
+	float cy[TRACK_NODE_MAX];
+	float cz[TRACK_NODE_MAX];
+	float ex[TRACK_NODE_MAX];
+	float ey[TRACK_NODE_MAX];
+	float ez[TRACK_NODE_MAX];
+	float bend[TRACK_NODE_MAX];
+	uint8_t dirty[TRACK_NODE_MAX];
+	int n_dirty;
+};
+
 struct track {
 	struct track_node nodes[TRACK_NODE_MAX];
 	int node_count;
+	struct track_bounds bounds;
 };
 
 struct track_node* track_get_node(struct track* track, int index);
 
 void track_init_demo(struct track* track);
 
+/* call after changing a node's points (or links); its bounds, and those of
+ * the node leading into it, are redone by the next track_update_bounds() */
+void track_node_changed(struct track* track, int index);
+void track_update_bounds(struct track* track);
+
 int track_node_bezier_derive_4_track_points(struct track* track, struct track_node_bezier* bezier, struct track_point* points);
 
 void track_points_construct_block(struct track_point* tps, int i, int N, struct vec3* points, struct vec3* normals);
 
+// the road surface and side skirts as an indexed triangle soup, for collision
+struct track_mesh {
+	struct vec3* vertices;
+	int n_vertices;
+	int vertices_cap;
+	int32_t* indices;
+	int n_triangles;
+	int triangles_cap;
+};
+
+void track_mesh_build(struct track_mesh* mesh, struct track* track);
+void track_mesh_free(struct track_mesh* mesh);
+
+/* the road's center line, BEZIER_SUBDIV points per node, following the
+ * next links from the first bezier node; closed if they come back to it */
+struct track_path {
+	struct vec3* points;
+	int n;
+	int cap;
+	int closed;
+};
+
+void track_path_build(struct track_path* path, struct track* track);
+void track_path_free(struct track_path* path);
+
 #endif/*TRACK_H*/